@@ -0,0 +1,138 @@
+/** @file */
+#include <time.h>
+
+#include "bench.h"
+#include "pacing.h"
+
+/*
+ * Microbenchmarks for the library's hot paths, built with -DRDPMUX_BUILD_BENCH=ON. Each one times a path next to
+ * the one it replaced, so that a change can be checked on the hardware it's going to run on.
+ *
+ * Run rdpmux_bench without arguments to run every benchmark, or pass the names of the ones to run.
+ */
+
+/**
+ * @brief A benchmark that can be picked from the command line.
+ */
+typedef struct MuxBench {
+    const char *name;
+    const char *description;
+    /**
+     * @brief Runs the benchmark. Returns 0 on success.
+     */
+    int (*run)(void);
+} MuxBench;
+
+static const MuxBench benches[] = {
+    { "copy", "regular vs non-temporal copies into shared memory", mux_bench_copy },
+    { "hugepages", "4K framebuffer copies with normal pages vs hugepages", mux_bench_hugepages },
+    { "queue", "outgoing queue vs the mutex-guarded list it replaced", mux_bench_queue },
+    { "roundtrip", "every outgoing message type reads back with cmp", mux_bench_roundtrip },
+    { "encode", "message encoding cost, cmp into a heap buffer vs a fixed buffer", mux_bench_encode },
+};
+
+/**
+ * @func Times an operation, repeating it until at least MUX_BENCH_MIN_NS have passed.
+ *
+ * @returns The average time per call in ns.
+ *
+ * @param fn The operation.
+ * @param ctx Passed to fn.
+ */
+double mux_bench_time(MuxBenchFunc fn, void *ctx)
+{
+    int64_t start_ns, elapsed_ns;
+    long i, n = 1;
+
+    // the first call warms up the caches and faults in any memory the operation touches.
+    fn(ctx);
+
+    while (true) {
+        start_ns = mux_time_ns();
+        for (i = 0; i < n; i++) {
+            fn(ctx);
+        }
+        elapsed_ns = mux_time_ns() - start_ns;
+
+        if (elapsed_ns >= MUX_BENCH_MIN_NS) {
+            return (double) elapsed_ns / n;
+        }
+        n *= 2;
+    }
+}
+
+/**
+ * @func Prints the result of a measurement.
+ *
+ * @param name What was measured.
+ * @param ns Average time per operation in ns.
+ * @param bytes Bytes moved per operation, or 0 if throughput doesn't apply.
+ */
+void mux_bench_report(const char *name, double ns, size_t bytes)
+{
+    if (bytes > 0) {
+        printf("  %-44s %12.1f ns/op %8.2f GB/s\n", name, ns, bytes / ns);
+    } else {
+        printf("  %-44s %12.1f ns/op\n", name, ns);
+    }
+}
+
+/**
+ * @func Allocates a 32bpp frame filled with noise, so that nothing about its contents can be optimized away.
+ *
+ * @returns The frame, to be freed with g_free().
+ *
+ * @param width Width of the frame in px.
+ * @param height Height of the frame in px.
+ */
+unsigned char *mux_bench_frame(int width, int height)
+{
+    size_t i, size = (size_t) width * height * 4;
+    unsigned char *frame = g_malloc(size);
+    uint32_t x = 2463534242u;
+
+    for (i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        frame[i] = (unsigned char) x;
+    }
+    return frame;
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int j, failed = 0;
+    bool found;
+
+    if (mux_init_display_struct(NULL) == NULL) {
+        return 1;
+    }
+
+    for (j = 1; j < argc; j++) {
+        found = false;
+        for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+            found |= strcmp(argv[j], benches[i].name) == 0;
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown benchmark %s. Available benchmarks:\n", argv[j]);
+            for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+                fprintf(stderr, "  %-12s %s\n", benches[i].name, benches[i].description);
+            }
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        found = argc == 1;
+        for (j = 1; j < argc; j++) {
+            found |= strcmp(argv[j], benches[i].name) == 0;
+        }
+        if (found) {
+            printf("%s: %s\n", benches[i].name, benches[i].description);
+            failed |= benches[i].run();
+        }
+    }
+    return failed;
+}
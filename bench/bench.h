@@ -0,0 +1,38 @@
+#ifndef SHIM_BENCH_H
+#define SHIM_BENCH_H
+
+#include "common.h"
+
+/**
+ * @brief Every measurement repeats its operation for at least this many ns.
+ */
+#define MUX_BENCH_MIN_NS 200000000LL
+
+/**
+ * @brief Width of the framebuffer the benchmarks work on, in px.
+ */
+#define MUX_BENCH_WIDTH 1920
+
+/**
+ * @brief Height of the framebuffer the benchmarks work on, in px.
+ */
+#define MUX_BENCH_HEIGHT 1080
+
+/**
+ * @brief Operation timed by mux_bench_time().
+ */
+typedef void (*MuxBenchFunc)(void *ctx);
+
+double mux_bench_time(MuxBenchFunc fn, void *ctx);
+void mux_bench_report(const char *name, double ns, size_t bytes);
+unsigned char *mux_bench_frame(int width, int height);
+
+int mux_bench_copy(void);
+int mux_bench_hugepages(void);
+int mux_bench_queue(void);
+int mux_bench_roundtrip(void);
+int mux_bench_encode(void);
+
+MuxDisplay *mux_init_display_struct(const char *uuid);
+
+#endif //SHIM_BENCH_H
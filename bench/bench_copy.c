@@ -0,0 +1,108 @@
+/** @file */
+#include "bench.h"
+#include "framebuffer.h"
+#include "kernels.h"
+
+/*
+ * Compares plain memcpy, the regular copy kernel and the non-temporal copy kernels on the kinds of copies the library
+ * makes into shared memory: whole frames on display switches, and full-width bands and windows on updates. The
+ * destination is read by the server from another process, so it doesn't benefit from being cached.
+ */
+
+/**
+ * @brief A rectangle copied from one frame into another.
+ */
+typedef struct MuxBenchCopy {
+    unsigned char *dst;
+    unsigned char *src;
+    int step;
+    int x, y, width, height;
+} MuxBenchCopy;
+
+static void mux_bench_copy_memcpy(void *ctx)
+{
+    MuxBenchCopy *c = ctx;
+    size_t offset = ((size_t) c->y * c->step) + (c->x * 4);
+    int row;
+
+    if (c->width * 4 == c->step) {
+        memcpy(c->dst + offset, c->src + offset, (size_t) c->step * c->height);
+        return;
+    }
+    for (row = 0; row < c->height; row++) {
+        memcpy(c->dst + offset + ((size_t) row * c->step), c->src + offset + ((size_t) row * c->step), c->width * 4);
+    }
+}
+
+static void mux_bench_copy_regular(void *ctx)
+{
+    MuxBenchCopy *c = ctx;
+    size_t offset = ((size_t) c->y * c->step) + (c->x * 4);
+    int row;
+
+    if (c->width * 4 == c->step) {
+        mux_kernels.copy(c->dst + offset, c->src + offset, (size_t) c->step * c->height);
+        return;
+    }
+    for (row = 0; row < c->height; row++) {
+        mux_kernels.copy(c->dst + offset + ((size_t) row * c->step), c->src + offset + ((size_t) row * c->step),
+                         c->width * 4);
+    }
+}
+
+static void mux_bench_copy_nt(void *ctx)
+{
+    MuxBenchCopy *c = ctx;
+    size_t offset = ((size_t) c->y * c->step) + (c->x * 4);
+
+    if (c->width * 4 == c->step) {
+        mux_kernels.copy_nt(c->dst + offset, c->src + offset, (size_t) c->step * c->height);
+        return;
+    }
+    mux_kernels.copy_nt_rows(c->dst + offset, c->step, c->src + offset, c->step, c->width * 4, c->height);
+}
+
+static void mux_bench_copy_auto(void *ctx)
+{
+    MuxBenchCopy *c = ctx;
+
+    mux_copy_pixels(c->dst, c->step, c->x, c->y, c->width, c->height, c->src, c->step, c->x, c->y, 32);
+}
+
+/**
+ * @func Runs the copy benchmark.
+ *
+ * @returns 0.
+ */
+int mux_bench_copy(void)
+{
+    unsigned char *src = mux_bench_frame(MUX_BENCH_WIDTH, MUX_BENCH_HEIGHT);
+    unsigned char *dst = mux_bench_frame(MUX_BENCH_WIDTH, MUX_BENCH_HEIGHT);
+    MuxBenchCopy cases[] = {
+        { dst, src, MUX_BENCH_WIDTH * 4, 0, 0, MUX_BENCH_WIDTH, MUX_BENCH_HEIGHT },
+        { dst, src, MUX_BENCH_WIDTH * 4, 0, 512, MUX_BENCH_WIDTH, 64 },
+        { dst, src, MUX_BENCH_WIDTH * 4, 320, 180, 1280, 720 },
+        { dst, src, MUX_BENCH_WIDTH * 4, 640, 500, 320, 64 },
+    };
+    const char *names[] = { "full frame", "full-width band", "1280x720 window", "320x64 window" };
+    char name[64];
+    size_t i;
+
+    printf("  using %s kernels, non-temporal from %d KB\n", mux_kernels.name, MUX_NT_COPY_MIN_BYTES / 1024);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t bytes = (size_t) cases[i].width * cases[i].height * 4;
+
+        snprintf(name, sizeof(name), "%s, memcpy", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_copy_memcpy, &cases[i]), bytes);
+        snprintf(name, sizeof(name), "%s, copy kernel", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_copy_regular, &cases[i]), bytes);
+        snprintf(name, sizeof(name), "%s, non-temporal kernel", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_copy_nt, &cases[i]), bytes);
+        snprintf(name, sizeof(name), "%s, mux_copy_pixels", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_copy_auto, &cases[i]), bytes);
+    }
+
+    g_free(src);
+    g_free(dst);
+    return 0;
+}
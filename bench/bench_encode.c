@@ -0,0 +1,364 @@
+/** @file */
+#include <inttypes.h>
+#include <malloc.h>
+
+#include "bench.h"
+#include "msgpack.h"
+
+/*
+ * Checks that every outgoing message type decodes with cmp_read_* into the fields the server expects, then compares
+ * the cost of encoding messages into a fixed buffer against the cmp writer growing a heap buffer, which is how
+ * messages were encoded before.
+ */
+
+/**
+ * @brief Kind of a field in an outgoing message.
+ */
+typedef enum MuxBenchFieldKind {
+    MUX_FIELD_UINT,
+    MUX_FIELD_INT,
+    MUX_FIELD_BOOL
+} MuxBenchFieldKind;
+
+/**
+ * @brief A field the server expects to read from an outgoing message.
+ */
+typedef struct MuxBenchField {
+    MuxBenchFieldKind kind;
+    int64_t value;
+} MuxBenchField;
+
+/**
+ * @brief Encoded message being read back by cmp.
+ */
+typedef struct MuxBenchReader {
+    const uint8_t *p;
+    size_t left;
+} MuxBenchReader;
+
+static bool mux_bench_read(cmp_ctx_t *ctx, void *data, size_t limit)
+{
+    MuxBenchReader *r = ctx->buf;
+
+    if (limit > r->left) {
+        return false;
+    }
+    memcpy(data, r->p, limit);
+    r->p += limit;
+    r->left -= limit;
+    return true;
+}
+
+/**
+ * @brief Lists the fields of a message in the order the server reads them.
+ *
+ * @returns The number of fields.
+ *
+ * @param update The update, or NULL for a shutdown message.
+ * @param f Filled in with the fields.
+ */
+static int mux_bench_fields(MuxUpdate *update, MuxBenchField *f)
+{
+    int i, n = 0;
+
+#define FIELD(k, v) (f[n++] = (MuxBenchField) { (k), (int64_t) (v) })
+    if (update == NULL) {
+        FIELD(MUX_FIELD_UINT, SHUTDOWN);
+        return n;
+    }
+
+    FIELD(MUX_FIELD_UINT, update->type);
+    switch (update->type) {
+        case DISPLAY_UPDATE:
+            FIELD(MUX_FIELD_UINT, update->disp_update.slot);
+            FIELD(MUX_FIELD_UINT, update->disp_update.seq);
+            FIELD(MUX_FIELD_UINT, update->disp_update.num_rects);
+            for (i = 0; i < update->disp_update.num_rects; i++) {
+                pixman_box32_t *r = &update->disp_update.rects[i];
+                FIELD(MUX_FIELD_UINT, r->x1);
+                FIELD(MUX_FIELD_UINT, r->y1);
+                FIELD(MUX_FIELD_UINT, r->x2 - r->x1);
+                FIELD(MUX_FIELD_UINT, r->y2 - r->y1);
+            }
+            break;
+        case DISPLAY_SWITCH:
+            FIELD(MUX_FIELD_UINT, update->disp_switch.format);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.w);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.h);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.shm_size);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.shm_generation);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.num_slots);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.slot_size);
+            FIELD(MUX_FIELD_UINT, update->disp_switch.seq);
+            break;
+        case COPY_RECT:
+            FIELD(MUX_FIELD_UINT, update->copy.seq);
+            FIELD(MUX_FIELD_UINT, update->copy.src.x1);
+            FIELD(MUX_FIELD_UINT, update->copy.src.y1);
+            FIELD(MUX_FIELD_UINT, update->copy.src.x2 - update->copy.src.x1);
+            FIELD(MUX_FIELD_UINT, update->copy.src.y2 - update->copy.src.y1);
+            FIELD(MUX_FIELD_UINT, update->copy.dst_x);
+            FIELD(MUX_FIELD_UINT, update->copy.dst_y);
+            break;
+        case FILL:
+            FIELD(MUX_FIELD_UINT, update->fill.seq);
+            FIELD(MUX_FIELD_UINT, update->fill.num_rects);
+            for (i = 0; i < update->fill.num_rects; i++) {
+                pixman_box32_t *r = &update->fill.rects[i];
+                FIELD(MUX_FIELD_UINT, r->x1);
+                FIELD(MUX_FIELD_UINT, r->y1);
+                FIELD(MUX_FIELD_UINT, r->x2 - r->x1);
+                FIELD(MUX_FIELD_UINT, r->y2 - r->y1);
+                FIELD(MUX_FIELD_UINT, update->fill.colours[i]);
+            }
+            break;
+        case CURSOR_DEFINE:
+            FIELD(MUX_FIELD_UINT, update->cursor.serial);
+            FIELD(MUX_FIELD_UINT, update->cursor.w);
+            FIELD(MUX_FIELD_UINT, update->cursor.h);
+            FIELD(MUX_FIELD_UINT, update->cursor.hot_x);
+            FIELD(MUX_FIELD_UINT, update->cursor.hot_y);
+            break;
+        case CURSOR_MOVE:
+            FIELD(MUX_FIELD_INT, update->cursor_pos.x);
+            FIELD(MUX_FIELD_INT, update->cursor_pos.y);
+            FIELD(MUX_FIELD_BOOL, update->cursor_pos.visible);
+            break;
+        default:
+            break;
+    }
+#undef FIELD
+    return n;
+}
+
+/**
+ * @brief Encodes a message and reads it back with cmp.
+ *
+ * @returns 0 if every field read back as expected and nothing was left over, 1 otherwise.
+ *
+ * @param update The update, or NULL for a shutdown message.
+ */
+static int mux_bench_roundtrip_one(MuxUpdate *update)
+{
+    static MuxBenchField fields[MUX_MSG_MAX_FIELDS];
+    uint8_t buf[MUX_MSG_MAX_SIZE];
+    MuxBenchReader reader = { buf, mux_write_outgoing_msg(update, buf) };
+    int i, n = mux_bench_fields(update, fields);
+    int type = update == NULL ? SHUTDOWN : update->type;
+    cmp_ctx_t cmp;
+    uint32_t size;
+    uint64_t u;
+    int64_t d;
+    bool b;
+
+    cmp_init(&cmp, &reader, mux_bench_read, NULL);
+
+    if (!cmp_read_array(&cmp, &size) || size != (uint32_t) n) {
+        fprintf(stderr, "  message type %d: bad array header\n", type);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        bool ok;
+
+        switch (fields[i].kind) {
+            case MUX_FIELD_UINT:
+                ok = cmp_read_uinteger(&cmp, &u) && u == (uint64_t) fields[i].value;
+                break;
+            case MUX_FIELD_INT:
+                ok = cmp_read_integer(&cmp, &d) && d == fields[i].value;
+                break;
+            default:
+                ok = cmp_read_bool(&cmp, &b) && b == (fields[i].value != 0);
+                break;
+        }
+        if (!ok) {
+            fprintf(stderr, "  message type %d: field %d doesn't read back as %" PRId64 "\n", type, i,
+                    fields[i].value);
+            return 1;
+        }
+    }
+
+    if (reader.left != 0) {
+        fprintf(stderr, "  message type %d: %zu bytes left over\n", type, reader.left);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fills in an update of the given type, with num_rects rectangles if it has any. Every field is derived from
+ * v, so that walking v over the boundaries of the msgpack integer formats covers every encoding.
+ */
+static void mux_bench_update(MuxUpdate *update, MessageType type, uint32_t v, int num_rects)
+{
+    int i;
+
+    memset(update, 0, sizeof(*update));
+    update->type = type;
+    switch (type) {
+        case DISPLAY_UPDATE:
+            update->disp_update.slot = v % 8;
+            update->disp_update.seq = v;
+            update->disp_update.num_rects = num_rects;
+            for (i = 0; i < num_rects; i++) {
+                update->disp_update.rects[i] = (pixman_box32_t) { v % 65536, i, (v % 65536) + i + 1, i + (v % 300) };
+            }
+            break;
+        case DISPLAY_SWITCH:
+            update->disp_switch.format = PIXMAN_x8r8g8b8;
+            update->disp_switch.w = v % 65536;
+            update->disp_switch.h = v % 4096;
+            update->disp_switch.shm_size = (size_t) v * 4096;
+            update->disp_switch.shm_generation = v;
+            update->disp_switch.num_slots = (v % 4) + 1;
+            update->disp_switch.slot_size = (size_t) v * 64;
+            update->disp_switch.seq = ~v;
+            break;
+        case COPY_RECT:
+            update->copy.seq = v;
+            update->copy.src = (pixman_box32_t) { v % 65536, v % 256, (v % 65536) + 64, (v % 256) + 32 };
+            update->copy.dst_x = v % 128;
+            update->copy.dst_y = v % 65536;
+            break;
+        case FILL:
+            update->fill.seq = v;
+            update->fill.num_rects = num_rects;
+            for (i = 0; i < num_rects; i++) {
+                update->fill.rects[i] = (pixman_box32_t) { i, v % 65536, i + 1, (v % 65536) + (v % 1000) + 1 };
+                update->fill.colours[i] = v * (i + 1);
+            }
+            break;
+        case CURSOR_DEFINE:
+            update->cursor.serial = v;
+            update->cursor.w = v % 256;
+            update->cursor.h = v % 128;
+            update->cursor.hot_x = v % 64;
+            update->cursor.hot_y = v % 32;
+            break;
+        case CURSOR_MOVE:
+            // the hotspot can be off the top or left edge of the framebuffer.
+            update->cursor_pos.x = (int) (v % 65536) - 32768;
+            update->cursor_pos.y = -(int) (v % 65536);
+            update->cursor_pos.visible = v % 2;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @func Checks that every outgoing message type reads back with cmp.
+ *
+ * @returns 0 if every message read back correctly, 1 otherwise.
+ */
+int mux_bench_roundtrip(void)
+{
+    static const uint32_t values[] = {
+        0, 1, 31, 32, 127, 128, 255, 256, 32767, 32768, 65535, 65536, 1048575, 0x7fffffff, 0x80000000, 0xffffffff
+    };
+    static const MessageType types[] = {
+        DISPLAY_UPDATE, DISPLAY_SWITCH, COPY_RECT, FILL, CURSOR_DEFINE, CURSOR_MOVE
+    };
+    MuxUpdate update;
+    size_t i, j;
+    int n, failed = mux_bench_roundtrip_one(NULL);
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        for (j = 0; j < sizeof(values) / sizeof(values[0]); j++) {
+            for (n = 0; n <= MUX_MAX_DAMAGE_RECTS; n++) {
+                mux_bench_update(&update, types[i], values[j], MIN(n, MUX_MAX_FILL_RECTS));
+                failed |= mux_bench_roundtrip_one(&update);
+            }
+        }
+    }
+
+    printf("  %s\n", failed ? "FAILED" : "every message type reads back");
+    return failed;
+}
+
+/**
+ * @brief Grows the message buffer as bytes come in, like the cmp writer outgoing messages used to go through.
+ */
+static size_t mux_bench_cmp_writer(cmp_ctx_t *ctx, const void *data, size_t count)
+{
+    nnStr *msg = (nnStr *) ctx->buf;
+
+    if (msg->buf == NULL) {
+        msg->buf = g_malloc0(count);
+        msg->size = malloc_usable_size(msg->buf);
+    } else if (msg->pos + count > msg->size) {
+        msg->buf = g_realloc(msg->buf, msg->size * 2);
+        msg->size *= 2;
+    }
+    memcpy((uint8_t *) msg->buf + msg->pos, data, count);
+    msg->pos += count;
+    return count;
+}
+
+/**
+ * @brief Encodes a message with cmp into a freshly allocated buffer, and frees it, like outgoing messages used to be.
+ */
+static void mux_bench_encode_cmp(void *ctx)
+{
+    static MuxBenchField fields[MUX_MSG_MAX_FIELDS];
+    MuxUpdate *update = ctx;
+    nnStr msg = { NULL, 0, 0 };
+    int i, n = mux_bench_fields(update, fields);
+    cmp_ctx_t cmp;
+
+    cmp_init(&cmp, &msg, NULL, mux_bench_cmp_writer);
+    cmp_write_array(&cmp, n);
+    for (i = 0; i < n; i++) {
+        switch (fields[i].kind) {
+            case MUX_FIELD_UINT:
+                cmp_write_uint(&cmp, (uint64_t) fields[i].value);
+                break;
+            case MUX_FIELD_INT:
+                cmp_write_int(&cmp, fields[i].value);
+                break;
+            default:
+                cmp_write_bool(&cmp, fields[i].value != 0);
+                break;
+        }
+    }
+    g_free(msg.buf);
+}
+
+static void mux_bench_encode_packed(void *ctx)
+{
+    static uint8_t buf[MUX_MSG_MAX_SIZE];
+
+    mux_write_outgoing_msg(ctx, buf);
+    __asm__ volatile("" : : "r"(buf) : "memory");
+}
+
+/**
+ * @func Runs the encoding benchmark, after checking that the encoder is correct.
+ *
+ * @returns 0 on success, 1 if a message didn't read back.
+ */
+int mux_bench_encode(void)
+{
+    MuxUpdate updates[4];
+    const char *names[] = { "display update, 1 rect", "display update, 16 rects", "fill, 16 rects", "cursor move" };
+    char name[64];
+    int i;
+
+    if (mux_bench_roundtrip()) {
+        return 1;
+    }
+
+    mux_bench_update(&updates[0], DISPLAY_UPDATE, 1000, 1);
+    mux_bench_update(&updates[1], DISPLAY_UPDATE, 1000, MUX_MAX_DAMAGE_RECTS);
+    mux_bench_update(&updates[2], FILL, 1000, MUX_MAX_FILL_RECTS);
+    mux_bench_update(&updates[3], CURSOR_MOVE, 1000, 0);
+
+    for (i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "%s, cmp into heap buffer", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_encode_cmp, &updates[i]), 0);
+        snprintf(name, sizeof(name), "%s, fixed buffer", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_encode_packed, &updates[i]), 0);
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/** @file */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+
+#include "bench.h"
+#include "framebuffer.h"
+#include "shm.h"
+
+/*
+ * Compares copy throughput into a 4K framebuffer in shared memory backed by normal pages against one backed by
+ * transparent hugepages, the way mux_set_hugepages() sets it up. The region is an anonymous memory file, like the one
+ * handed to the server. Besides whole-frame copies, damage is synced tile by tile down the columns of the frame,
+ * which touches a different set of pages on every row and is where TLB misses hurt most.
+ */
+
+#define MUX_BENCH_4K_WIDTH 3840
+#define MUX_BENCH_4K_HEIGHT 2160
+
+/**
+ * @brief A framebuffer in shared memory, and the frame copied into it.
+ */
+typedef struct MuxBenchRegion {
+    unsigned char *dst;
+    unsigned char *src;
+} MuxBenchRegion;
+
+/**
+ * @brief Creates a shared memory region like the library does, optionally asking for hugepages.
+ *
+ * @returns The mapping, or NULL if it couldn't be created.
+ *
+ * @param size Size of the region in bytes.
+ * @param hugepages Whether to advise the kernel to use transparent hugepages.
+ */
+static unsigned char *mux_bench_region_new(size_t size, bool hugepages)
+{
+    int fd = memfd_create("rdpmux-bench", MFD_CLOEXEC);
+    void *p;
+
+    if (fd < 0 || ftruncate(fd, size)) {
+        fprintf(stderr, "  memfd setup failed: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "  mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (hugepages && madvise(p, size, MADV_HUGEPAGE)) {
+        printf("  hugepages unavailable: %s\n", strerror(errno));
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+/**
+ * @brief Looks up how much of a mapping is backed by hugepages.
+ *
+ * @returns The size in KB, or -1 if it's unknown.
+ *
+ * @param addr Start of the mapping.
+ */
+static long mux_bench_huge_kb(void *addr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256], start[32];
+    long kb = -1;
+    bool in_mapping = false;
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    snprintf(start, sizeof(start), "%lx-", (unsigned long) addr);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strchr(line, '-') != NULL && strchr(line, ':') != NULL && strchr(line, '-') < strchr(line, ' ')) {
+            in_mapping = strncmp(line, start, strlen(start)) == 0;
+        } else if (in_mapping && sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static void mux_bench_hugepages_copy(void *ctx)
+{
+    MuxBenchRegion *r = ctx;
+
+    mux_copy_pixels(r->dst, MUX_BENCH_4K_WIDTH * 4, 0, 0, MUX_BENCH_4K_WIDTH, MUX_BENCH_4K_HEIGHT,
+                    r->src, MUX_BENCH_4K_WIDTH * 4, 0, 0, 32);
+}
+
+static void mux_bench_hugepages_tiles(void *ctx)
+{
+    MuxBenchRegion *r = ctx;
+    pixman_box32_t bounds;
+    int x, y;
+
+    for (x = 0; x < MUX_BENCH_4K_WIDTH; x += MUX_TILE_SIZE) {
+        for (y = 0; y < MUX_BENCH_4K_HEIGHT; y += MUX_TILE_SIZE) {
+            mux_copy_compare_pixels(r->dst, r->dst, MUX_BENCH_4K_WIDTH * 4, r->src, MUX_BENCH_4K_WIDTH * 4, x, y,
+                                    MIN(MUX_TILE_SIZE, MUX_BENCH_4K_WIDTH - x),
+                                    MIN(MUX_TILE_SIZE, MUX_BENCH_4K_HEIGHT - y), 32, NULL, &bounds);
+        }
+    }
+}
+
+/**
+ * @func Runs the hugepage benchmark.
+ *
+ * @returns 0 on success, 1 if the shared memory regions couldn't be created.
+ */
+int mux_bench_hugepages(void)
+{
+    size_t frame_size = (size_t) MUX_BENCH_4K_WIDTH * MUX_BENCH_4K_HEIGHT * 4;
+    size_t size = ((frame_size + MUX_HUGEPAGE_SIZE - 1) / MUX_HUGEPAGE_SIZE) * MUX_HUGEPAGE_SIZE;
+    unsigned char *src = mux_bench_frame(MUX_BENCH_4K_WIDTH, MUX_BENCH_4K_HEIGHT);
+    MuxBenchRegion regions[2] = {
+        { mux_bench_region_new(size, false), src },
+        { mux_bench_region_new(size, true), src },
+    };
+    const char *names[] = { "normal pages", "hugepages" };
+    char name[64];
+    int i;
+
+    if (regions[0].dst == NULL || regions[1].dst == NULL) {
+        g_free(src);
+        return 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        printf("  %s: %ld KB of %zu KB mapped with hugepages\n", names[i], mux_bench_huge_kb(regions[i].dst),
+               size / 1024);
+        snprintf(name, sizeof(name), "%s, full frame copy", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_hugepages_copy, &regions[i]), frame_size);
+        snprintf(name, sizeof(name), "%s, tile sync down columns", names[i]);
+        mux_bench_report(name, mux_bench_time(mux_bench_hugepages_tiles, &regions[i]), frame_size);
+    }
+
+    munmap(regions[0].dst, size);
+    munmap(regions[1].dst, size);
+    g_free(src);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/** @file */
+#include <pthread.h>
+#include <sched.h>
+
+#include "bench.h"
+#include "queue.h"
+
+/*
+ * Compares the outgoing queue against the queue it replaced: a SIMPLEQ list guarded by a mutex and a condition
+ * variable, with every update allocated on enqueue and freed after dequeueing. Several producer threads stand in for
+ * the hypervisor and out loop threads, and a single consumer stands in for the mainloop.
+ *
+ * Producers keep at most MUX_BENCH_QUEUE_DEPTH updates in flight between them, like a server acknowledging frames
+ * would, so that the lock-free ring is measured rather than its overflow list.
+ */
+
+/**
+ * @brief Number of updates each producer thread enqueues per run.
+ */
+#define MUX_BENCH_QUEUE_UPDATES 100000
+
+/**
+ * @brief Number of updates in flight at most.
+ */
+#define MUX_BENCH_QUEUE_DEPTH (MUX_QUEUE_SIZE / 2)
+
+/**
+ * @brief The outgoing queue before it was made lock-free.
+ */
+typedef struct MuxBenchMutexQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SIMPLEQ_HEAD(, MuxUpdate) updates;
+} MuxBenchMutexQueue;
+
+/**
+ * @brief State shared by the threads of a run.
+ */
+typedef struct MuxBenchQueue {
+    /**
+     * @brief Whether to use the old queue rather than the current one.
+     */
+    bool mutex;
+    MuxBenchMutexQueue old;
+    MuxMsgQueue ring;
+    int producers;
+    /**
+     * @brief Updates enqueued but not dequeued yet.
+     */
+    int outstanding;
+} MuxBenchQueue;
+
+static void mux_bench_mutex_enqueue(MuxBenchMutexQueue *q, MuxUpdate *update)
+{
+    pthread_mutex_lock(&q->lock);
+    SIMPLEQ_INSERT_TAIL(&q->updates, update, next);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static MuxUpdate *mux_bench_mutex_dequeue(MuxBenchMutexQueue *q)
+{
+    MuxUpdate *update;
+
+    pthread_mutex_lock(&q->lock);
+    while (SIMPLEQ_EMPTY(&q->updates)) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    update = SIMPLEQ_FIRST(&q->updates);
+    SIMPLEQ_REMOVE_HEAD(&q->updates, next);
+    pthread_mutex_unlock(&q->lock);
+    return update;
+}
+
+static void *mux_bench_queue_producer(void *arg)
+{
+    MuxBenchQueue *b = arg;
+    MuxUpdate *update;
+    int i;
+
+    for (i = 0; i < MUX_BENCH_QUEUE_UPDATES; i++) {
+        while (__atomic_load_n(&b->outstanding, __ATOMIC_RELAXED) >= MUX_BENCH_QUEUE_DEPTH) {
+            sched_yield();
+        }
+        __atomic_add_fetch(&b->outstanding, 1, __ATOMIC_RELAXED);
+
+        if (b->mutex) {
+            update = g_malloc0(sizeof(MuxUpdate));
+            update->type = DISPLAY_UPDATE;
+            mux_bench_mutex_enqueue(&b->old, update);
+        } else {
+            update = mux_update_new();
+            update->type = DISPLAY_UPDATE;
+            mux_queue_enqueue(&b->ring, update);
+        }
+    }
+    return NULL;
+}
+
+static void mux_bench_queue_run(void *ctx)
+{
+    MuxBenchQueue *b = ctx;
+    pthread_t threads[8];
+    long i;
+
+    for (i = 0; i < b->producers; i++) {
+        pthread_create(&threads[i], NULL, mux_bench_queue_producer, b);
+    }
+
+    for (i = 0; i < (long) b->producers * MUX_BENCH_QUEUE_UPDATES; i++) {
+        if (b->mutex) {
+            g_free(mux_bench_mutex_dequeue(&b->old));
+        } else {
+            mux_update_free(mux_queue_dequeue(&b->ring));
+        }
+        __atomic_sub_fetch(&b->outstanding, 1, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < b->producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * @func Runs the queue benchmark.
+ *
+ * @returns 0 on success, 1 if the queue couldn't be set up.
+ */
+int mux_bench_queue(void)
+{
+    MuxBenchQueue b = { 0 };
+    int producers[] = { 1, 2, 4 };
+    char name[64];
+    size_t i;
+
+    pthread_mutex_init(&b.old.lock, NULL);
+    pthread_cond_init(&b.old.cond, NULL);
+    SIMPLEQ_INIT(&b.old.updates);
+    if (!mux_queue_init(&b.ring)) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(producers) / sizeof(producers[0]); i++) {
+        b.producers = producers[i];
+
+        b.mutex = true;
+        snprintf(name, sizeof(name), "%d producer(s), mutex list", b.producers);
+        mux_bench_report(name, mux_bench_time(mux_bench_queue_run, &b) / (b.producers * MUX_BENCH_QUEUE_UPDATES), 0);
+
+        b.mutex = false;
+        snprintf(name, sizeof(name), "%d producer(s), lock-free ring", b.producers);
+        mux_bench_report(name, mux_bench_time(mux_bench_queue_run, &b) / (b.producers * MUX_BENCH_QUEUE_UPDATES), 0);
+    }
+    return 0;
+}
@@ -30,6 +30,14 @@ void mux_register_event_callbacks(InputEventCallbacks cb);
 MuxDisplay *mux_init_display_struct(const char *uuid);
 bool mux_connect(const char *path);
 bool mux_get_socket_path(const char *name, const char *obj, char **out_path, int id);
+bool mux_set_copy_threads(int nthreads);
+void mux_set_framebuffer_slots(int nslots);
+void mux_set_ackless_updates(bool enabled);
+void mux_set_hugepages(bool enabled);
+bool mux_start_refresh_timer(void);
+pixman_image_t *mux_create_shared_surface(int width, int height, pixman_format_code_t format);
+void mux_cursor_define(int width, int height, int hot_x, int hot_y, const uint32_t *pixels);
+void mux_cursor_move(int x, int y, bool visible);
 void mux_cleanup(MuxDisplay *display);
 
 #endif //SHIM_EXTERNAL_H
@@ -1,6 +1,8 @@
 /** @file */
 #include "0mq.h"
 #include "common.h"
+#include "msgpack.h"
+#include "queue.h"
 
 /**
  * @brief Receives data through the given 0mq socket and sticks it into buf.
@@ -49,30 +51,142 @@ int mux_0mq_recv_msg(void **buf)
     return len;
 }
 
+/**
+ * @brief Takes a buffer for an outgoing message from the pool, or from the heap if the pool is empty.
+ *
+ * @returns A buffer of MUX_MSG_MAX_SIZE bytes, to be handed to mux_0mq_send_msg().
+ */
+uint8_t *mux_0mq_buffer_new(void)
+{
+    MuxMsgBufferPool *pool = &display->zmq.buffers;
+    int i = mux_free_stack_pop(&pool->free);
+
+    if (i < 0) {
+        return g_malloc(MUX_MSG_MAX_SIZE);
+    }
+    return pool->buffers + ((size_t) i * MUX_MSG_MAX_SIZE);
+}
+
+/**
+ * @brief Hands a message buffer back to the pool it came from, or to the heap.
+ *
+ * @param pool The pool.
+ * @param buf The buffer.
+ */
+static void mux_0mq_buffer_put(MuxMsgBufferPool *pool, uint8_t *buf)
+{
+    if (buf < pool->buffers || buf >= pool->buffers + (MUX_MSG_BUFFER_POOL_SIZE * MUX_MSG_MAX_SIZE)) {
+        g_free(buf);
+        return;
+    }
+    mux_free_stack_push(&pool->free, (int) ((buf - pool->buffers) / MUX_MSG_MAX_SIZE));
+}
+
+/**
+ * @brief Drops a reference to a message buffer pool, and frees its buffers if it was the last one.
+ *
+ * @param pool The pool.
+ */
+static void mux_0mq_pool_unref(MuxMsgBufferPool *pool)
+{
+    if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        g_free(pool->buffers);
+        g_free(pool->free.next);
+        pool->buffers = NULL;
+        pool->free.next = NULL;
+    }
+}
+
+/**
+ * @brief Hands a message buffer back to its pool once ZeroMQ is done sending it. Called by ZeroMQ, on its I/O thread.
+ *
+ * @param data The buffer.
+ * @param hint The pool the buffer came from.
+ */
+static void mux_0mq_buffer_free(void *data, void *hint)
+{
+    mux_0mq_buffer_put(hint, data);
+    mux_0mq_pool_unref(hint);
+}
+
+/**
+ * @brief Takes a reference to the display's message buffer pool, which keeps its buffers around until it's dropped
+ * with mux_0mq_buffers_unref().
+ */
+void mux_0mq_buffers_ref(void)
+{
+    __atomic_add_fetch(&display->zmq.buffers.refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drops a reference to the display's message buffer pool. Buffers still held by ZeroMQ keep the pool alive
+ * until they come back.
+ */
+void mux_0mq_buffers_unref(void)
+{
+    if (display->zmq.buffers.buffers != NULL) {
+        mux_0mq_pool_unref(&display->zmq.buffers);
+    }
+}
+
 /**
  * @brief Send a message through the 0mq socket.
  *
+ * The UUID frame shares its data with a frame built once at connection time, and the message is handed to ZeroMQ
+ * without being copied, so nothing is allocated or copied per message. Messages small enough to be stored inside the
+ * zmq_msg_t itself are copied there instead, since that's cheaper than a buffer handover.
+ *
  * This function is blocking.
  *
- * @returns The number of bytes sent.
+ * @returns The number of bytes sent, or -1 on failure.
  *
- * @param buf The data to send.
+ * @param buf The data to send, from mux_0mq_buffer_new(). Owned by this function from here on, whether or not the
+ * send succeeds.
  * @param len The length of buf.
  */
-int mux_0mq_send_msg(void *buf, size_t len)
+int mux_0mq_send_msg(uint8_t *buf, size_t len)
 {
-    zmsg_t *msg = zmsg_new();
+    void *socket = zsock_resolve(display->zmq.socket);
+    MuxMsgBufferPool *pool = &display->zmq.buffers;
+    zmq_msg_t identity;
+    zmq_msg_t data;
 
     mux_printf("Now attempting to send message!");
-    zmsg_addstr(msg, display->uuid);
-    zmsg_addmem(msg, buf, len);
 
-    if (zmsg_size(msg) != 2) {
-        mux_printf_error("Something went wrong building zmsg");
+    if (len <= MUX_ZMQ_INLINE_SIZE) {
+        zmq_msg_init_size(&data, len);
+        memcpy(zmq_msg_data(&data), buf, len);
+        mux_0mq_buffer_put(pool, buf);
+    } else {
+        // the buffer keeps the pool alive until ZeroMQ hands it back
+        __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+        if (zmq_msg_init_data(&data, buf, len, mux_0mq_buffer_free, pool) != 0) {
+            mux_printf_error("Could not build message: %s", zmq_strerror(zmq_errno()));
+            mux_0mq_buffer_free(buf, pool);
+            return -1;
+        }
+    }
+
+    zmq_msg_init(&identity);
+    zmq_msg_copy(&identity, &display->zmq.identity);
+
+    if (zmq_msg_send(&identity, socket, ZMQ_SNDMORE) < 0) {
+        mux_printf_error("Could not send message: %s", zmq_strerror(zmq_errno()));
+        zmq_msg_close(&identity);
+        zmq_msg_close(&data);
         return -1;
     }
 
-    zmsg_send(&msg, display->zmq.socket); // TODO: figure out how return code works for this
+    // the UUID frame is on its way, so only the data frame may be retried. sending another UUID frame would make the
+    // server read it as the data of this message. if the context is gone, the message is dropped along with it.
+    while (zmq_msg_send(&data, socket, 0) < 0) {
+        if (zmq_errno() == ETERM) {
+            mux_printf_error("Could not send message: %s", zmq_strerror(zmq_errno()));
+            zmq_msg_close(&data);
+            return -1;
+        }
+        mux_printf_error("Could not send message data, retrying: %s", zmq_strerror(zmq_errno()));
+    }
 
     return len;
 }
@@ -111,11 +225,16 @@ __PUBLIC bool mux_connect(const char *path)
     }
     mux_printf("Bound to %s", path);
 
-    display->zmq.poller = zpoller_new(display->zmq.socket, NULL);
-    if (display->zmq.poller == NULL) {
-        mux_printf_error("Could not initialize socket poller");
+    if (display->uuid == NULL) {
+        mux_printf_error("No UUID to identify messages with");
         return false;
     }
+    zmq_msg_init_size(&display->zmq.identity, strlen(display->uuid));
+    memcpy(zmq_msg_data(&display->zmq.identity), display->uuid, strlen(display->uuid));
+
+    display->zmq.buffers.buffers = g_malloc(MUX_MSG_BUFFER_POOL_SIZE * MUX_MSG_MAX_SIZE);
+    mux_free_stack_init(&display->zmq.buffers.free, MUX_MSG_BUFFER_POOL_SIZE);
+    display->zmq.buffers.refs = 1; // dropped by mux_cleanup()
 
     return true;
 }
@@ -7,8 +7,16 @@
 
 #include "common.h"
 
+/**
+ * @brief Messages up to this size fit inside a zmq_msg_t, where libzmq stores them without allocating.
+ */
+#define MUX_ZMQ_INLINE_SIZE 32
+
 int mux_0mq_recv_msg(void **buf);
-int mux_0mq_send_msg(void *buf, size_t len);
+uint8_t *mux_0mq_buffer_new(void);
+void mux_0mq_buffers_ref(void);
+void mux_0mq_buffers_unref(void);
+int mux_0mq_send_msg(uint8_t *buf, size_t len);
 bool mux_connect(const char *path);
 
 #endif //SHIM_NANOMSG_H
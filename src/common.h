@@ -26,7 +26,52 @@
 /**
  * @brief Protocol version.
  */
-#define RDPMUX_PROTOCOL_VERSION 3
+#define RDPMUX_PROTOCOL_VERSION 12
+
+/**
+ * @brief Maximum number of rectangles carried by a single display update.
+ *
+ * Damage regions made up of more rectangles than this are collapsed into their bounding box before being sent.
+ */
+#define MUX_MAX_DAMAGE_RECTS 16
+
+/**
+ * @brief Maximum number of solid fills carried by a single fill message. Further solid rectangles are sent as damage.
+ */
+#define MUX_MAX_FILL_RECTS 16
+
+/**
+ * @brief Number of updates the outgoing queue holds before spilling into its overflow list. Must be a power of two.
+ */
+#define MUX_QUEUE_SIZE 256
+
+/**
+ * @brief Number of preallocated updates recycled between the threads that queue updates and the mainloop. Updates
+ * beyond this many in flight come from the heap.
+ */
+#define MUX_UPDATE_POOL_SIZE 64
+
+/**
+ * @brief Number of preallocated buffers outgoing messages are encoded into. Messages beyond this many waiting to be
+ * sent by ZeroMQ get buffers from the heap.
+ */
+#define MUX_MSG_BUFFER_POOL_SIZE 32
+
+/**
+ * @brief Size of a cache line, used to keep data written by different threads apart.
+ */
+#define MUX_CACHE_LINE 64
+
+/**
+ * @brief Maximum number of framebuffer slots in the shared memory region.
+ */
+#define MUX_MAX_FRAMEBUFFER_SLOTS 3
+
+/**
+ * @brief Number of rectangles of a shared surface whose published contents are remembered, to spot damage that didn't
+ * change anything.
+ */
+#define MUX_RECT_HASH_ENTRIES 64
 
 /**
  * @brief debug output macro
@@ -64,34 +109,89 @@ typedef enum message_type {
     MOUSE,
     KEYBOARD,
     DISPLAY_UPDATE_COMPLETE,
-    SHUTDOWN
+    SHUTDOWN,
+    FORMAT_REQUEST,
+    CURSOR_DEFINE,
+    CURSOR_MOVE,
+    COPY_RECT,
+    FILL
 } MessageType;
 
 /**
  * @brief Parameters for a display update event.
  *
- * Display updates carry coordinates for a rectangular screen region, denoted as the coordinates of the top left corner
- * and the coordinates of the bottom right corner. All values are in px.
+ * Display updates carry a list of non-overlapping rectangular screen regions. Each rectangle is denoted as the
+ * coordinates of its top left corner and the coordinates of its bottom right corner. All values are in px.
  */
 typedef struct display_update {
     /**
-     * @brief X-coordinate of top left corner of region
+     * @brief Index of the framebuffer slot holding the updated frame.
      */
-    int x1;
+    int slot;
     /**
-     * @brief Y-coordinate of top left corner of region
+     * @brief Sequence number of the frame. The server acknowledges the update with it.
      */
-    int y1;
+    uint32_t seq;
     /**
-     * @brief X-coordinate of bottom right corner of region
+     * @brief Number of valid entries in rects.
      */
-    int x2;
+    int num_rects;
     /**
-     * @brief X-coordinate of bottom right corner of region
+     * @brief The updated rectangles.
      */
-    int y2;
+    pixman_box32_t rects[MUX_MAX_DAMAGE_RECTS];
 } display_update;
 
+/**
+ * @brief Parameters for a copy within the framebuffer, such as a scroll.
+ *
+ * A copy is sent right before the display update of the same frame. The server applies it to the frame the update is
+ * relative to, and then the update's rectangles on top.
+ */
+typedef struct copy_rect {
+    /**
+     * @brief Sequence number of the frame the copy belongs to.
+     */
+    uint32_t seq;
+    /**
+     * @brief The rectangle to copy.
+     */
+    pixman_box32_t src;
+    /**
+     * @brief X-coordinate the top-left corner of the rectangle is copied to.
+     */
+    int dst_x;
+    /**
+     * @brief Y-coordinate the top-left corner of the rectangle is copied to.
+     */
+    int dst_y;
+} copy_rect;
+
+/**
+ * @brief Parameters for a set of solid fills.
+ *
+ * Fills are sent right before the display update of the same frame, after any copy. The server paints them on top of
+ * the frame the update is relative to, in order, before reading the update's rectangles.
+ */
+typedef struct fill_update {
+    /**
+     * @brief Sequence number of the frame the fills belong to.
+     */
+    uint32_t seq;
+    /**
+     * @brief Number of valid entries in rects and colours.
+     */
+    int num_rects;
+    /**
+     * @brief The filled rectangles.
+     */
+    pixman_box32_t rects[MUX_MAX_FILL_RECTS];
+    /**
+     * @brief Colour of each rectangle, as a pixel value in the framebuffer's format.
+     */
+    uint32_t colours[MUX_MAX_FILL_RECTS];
+} fill_update;
+
 /**
  * @brief Parameters for a display switch event.
  */
@@ -112,8 +212,73 @@ typedef struct display_switch {
      * @brief height of framebuffer in px.
      */
     int h;
+    /**
+     * @brief size of the shared memory region in bytes.
+     */
+    size_t shm_size;
+    /**
+     * @brief generation of the shared memory region, or zero for the named region.
+     */
+    uint32_t shm_generation;
+    /**
+     * @brief number of framebuffer slots in the shared memory region.
+     */
+    int num_slots;
+    /**
+     * @brief size of each framebuffer slot in bytes. Slot n starts n * slot_size bytes into the region.
+     */
+    size_t slot_size;
+    /**
+     * @brief Sequence number of the frame. The full frame is in slot 0, and the server acknowledges it with this.
+     */
+    uint32_t seq;
 } display_switch;
 
+/**
+ * @brief Parameters for a cursor shape change. The cursor image itself is in the cursor area of the shared memory
+ * region.
+ */
+typedef struct cursor_define {
+    /**
+     * @brief Serial number of the cursor image, which changes every time it's redefined.
+     */
+    uint32_t serial;
+    /**
+     * @brief width of the cursor image in px.
+     */
+    int w;
+    /**
+     * @brief height of the cursor image in px.
+     */
+    int h;
+    /**
+     * @brief X-coordinate of the cursor's hotspot within the image.
+     */
+    int hot_x;
+    /**
+     * @brief Y-coordinate of the cursor's hotspot within the image.
+     */
+    int hot_y;
+} cursor_define;
+
+/**
+ * @brief Parameters for a cursor move.
+ */
+typedef struct cursor_move {
+    /**
+     * @brief X-coordinate of the cursor's hotspot on the framebuffer in px.
+     */
+    int x;
+    /**
+     * @brief Y-coordinate of the cursor's hotspot on the framebuffer in px.
+     */
+    int y;
+    /**
+     * @brief Whether the cursor should be drawn at all.
+     */
+    bool visible;
+} cursor_move;
+
 /**
  * @brief Parameters for a keyboard event.
  */
@@ -160,6 +325,10 @@ typedef struct update_ack {
      * @brief new target framerate for the guest.
      */
     uint32_t framerate;
+    /**
+     * @brief sequence number of the acknowledged frame.
+     */
+    uint32_t seq;
 } update_ack;
 
 /**
@@ -194,20 +363,352 @@ typedef struct MuxUpdate {
         mouse_update mouse;
         update_ack ack;
         shut_down shutdown;
+        cursor_define cursor;
+        cursor_move cursor_pos;
+        copy_rect copy;
+        fill_update fill;
     };
 } MuxUpdate;
 
 /**
- * @brief queue to hold ShimUpdate objects.
+ * @brief Lock-free stack of the indices of the free entries of a pool.
+ */
+typedef struct MuxFreeStack {
+    /**
+     * @brief For each free entry, the index plus one of the free entry below it on the stack, or 0 at the bottom.
+     */
+    uint32_t *next;
+    /**
+     * @brief Index plus one of the free entry on top of the stack, or 0 if the pool is empty, in the low 32 bits. The
+     * high 32 bits count changes to the stack, so that a pop racing with a pop and push of the same entry fails.
+     */
+    uint64_t top;
+} MuxFreeStack;
+
+/**
+ * @brief Pool of preallocated updates.
+ */
+typedef struct MuxUpdatePool {
+    /**
+     * @brief The preallocated updates.
+     */
+    MuxUpdate *updates;
+    MuxFreeStack free;
+} MuxUpdatePool;
+
+/**
+ * @brief Pool of preallocated buffers for encoded outgoing messages. Buffers are handed to ZeroMQ along with the
+ * message, and come back from its I/O thread once the message is sent.
+ */
+typedef struct MuxMsgBufferPool {
+    /**
+     * @brief MUX_MSG_BUFFER_POOL_SIZE buffers of MUX_MSG_MAX_SIZE bytes each.
+     */
+    uint8_t *buffers;
+    MuxFreeStack free;
+    /**
+     * @brief References to the pool: one held by the display, one by the running mainloop, and one per buffer held
+     * by ZeroMQ. The buffers are freed when the last one is dropped.
+     */
+    uint32_t refs;
+} MuxMsgBufferPool;
+
+/**
+ * @brief Cell of the outgoing queue's ring.
+ */
+typedef struct MuxQueueCell {
+    /**
+     * @brief Position in the ring the cell is ready for. A producer may fill the cell when this equals its position,
+     * and the consumer may empty it when this is one past it. Emptying the cell moves it on by MUX_QUEUE_SIZE, to the
+     * next lap around the ring, so a cell is never mistaken for one from a previous lap.
+     */
+    size_t seq;
+    MuxUpdate *update;
+} MuxQueueCell;
+
+/**
+ * @brief Queue of updates waiting to be sent to the server.
  *
- * This is a very simple queue backed by a linked list. Nothing fancy, gets the job done.
+ * The queue is a bounded lock-free ring that any thread can enqueue to and dequeue from. Updates that don't fit in the
+ * ring spill over into a mutex-guarded list, which is drained once the ring is empty.
  */
 typedef struct MuxMsgQueue {
+    /**
+     * @brief Position of the next update to be enqueued.
+     */
+    size_t tail;
+    char tail_pad[MUX_CACHE_LINE - sizeof(size_t)];
+    /**
+     * @brief Position of the next update to be dequeued.
+     */
+    size_t head;
+    char head_pad[MUX_CACHE_LINE - sizeof(size_t)];
+    MuxQueueCell cells[MUX_QUEUE_SIZE];
+    /**
+     * @brief Set while updates are waiting in the overflow list. New updates go to the list too, so that they stay
+     * behind the updates already waiting there.
+     */
+    bool spilled;
+    /**
+     * @brief Set while the consumer is about to sleep on event_fd, so that producers know to signal it.
+     */
+    bool waiting;
+    /**
+     * @brief Lock guarding the overflow list.
+     */
     pthread_mutex_t lock;
-    pthread_cond_t cond; // signals when not empty
+    /**
+     * @brief eventfd that becomes readable when an update is queued while the consumer is waiting, or when the
+     * consumer is asked to wake up. Lets the queue be polled alongside sockets.
+     */
+    int event_fd;
     SIMPLEQ_HEAD(, MuxUpdate) updates;
 } MuxMsgQueue;
 
+/**
+ * @brief Ownership states of a framebuffer slot.
+ */
+typedef enum framebuffer_slot_state {
+    /**
+     * @brief Nobody is using the slot. The library may write to it.
+     */
+    MUX_SLOT_FREE,
+    /**
+     * @brief The library is currently writing a frame into the slot.
+     */
+    MUX_SLOT_WRITING,
+    /**
+     * @brief The slot holds a frame that has not been sent to the server yet. The library may still add to it.
+     */
+    MUX_SLOT_READY,
+    /**
+     * @brief The server has been told about the frame in the slot and may be reading it until it acknowledges it.
+     */
+    MUX_SLOT_INFLIGHT
+} MuxSlotState;
+
+/**
+ * @brief Bookkeeping for one framebuffer slot in the shared memory region.
+ */
+typedef struct MuxFramebufferSlot {
+    MuxSlotState state;
+    /**
+     * @brief Sequence number of the last frame published in this slot.
+     */
+    uint32_t seq;
+    /**
+     * @brief Sequence number of the frame that the pending update is relative to.
+     */
+    uint32_t base_seq;
+    /**
+     * @brief Region where the contents of the slot lag behind the latest frame.
+     */
+    pixman_region32_t stale;
+    /**
+     * @brief Region of the frame in the slot that changed and has not been sent yet.
+     */
+    pixman_region32_t update;
+    /**
+     * @brief Whether the pending update starts with a copy of part of frame base_seq.
+     */
+    bool has_copy;
+    copy_rect copy;
+    /**
+     * @brief Solid fills that the pending update paints before its rectangles.
+     */
+    fill_update fill;
+    /**
+     * @brief When the frame in the slot was handed to the server, in ns.
+     */
+    int64_t sent_ns;
+} MuxFramebufferSlot;
+
+/**
+ * @brief Hash of the contents of a rectangle, as they were when it was last published.
+ */
+typedef struct MuxRectHash {
+    pixman_box32_t box;
+    uint64_t hash;
+} MuxRectHash;
+
+/**
+ * @brief Scratch space of scroll detection, kept between refreshes so that looking for a scroll doesn't allocate.
+ */
+typedef struct MuxScrollScratch {
+    /**
+     * @brief Line hashes of the previous and the new frame, two per line.
+     */
+    uint64_t *hashes;
+    /**
+     * @brief Hash table of the lines of the previous frame, with room for twice as many lines, rounded up to a
+     * power of two.
+     */
+    struct MuxLineEntry *table;
+    /**
+     * @brief One vote count per possible shift, two per line plus one.
+     */
+    int *votes;
+    /**
+     * @brief Number of lines the buffers have room for.
+     */
+    int lines;
+} MuxScrollScratch;
+
+/**
+ * @brief State of the frame pacing controller, which picks the interval returned by mux_display_refresh().
+ */
+typedef struct MuxPacing {
+    /**
+     * @brief Current refresh interval in ns.
+     */
+    int64_t interval_ns;
+    /**
+     * @brief Average share of refreshes that found damage, where MUX_PACING_ONE means all of them.
+     */
+    int32_t activity;
+    /**
+     * @brief Average time spent copying a frame into shared memory, in ns.
+     */
+    int64_t copy_ns;
+    /**
+     * @brief Average time the server takes to acknowledge a frame, in ns. Written by the mainloop thread.
+     */
+    int64_t rtt_ns;
+    /**
+     * @brief Set by the mainloop thread when input arrives from the server.
+     */
+    bool input;
+} MuxPacing;
+
+/**
+ * @brief Magic number at the start of the shared memory header, "RDMX" in little-endian byte order.
+ */
+#define MUX_SHM_MAGIC 0x584d4452
+
+/**
+ * @brief Version of the shared memory header layout.
+ */
+#define MUX_SHM_HEADER_VERSION 2
+
+/**
+ * @brief Bytes reserved for the header at the start of the shared memory region. The cursor area starts right after.
+ */
+#define MUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief Largest cursor image the library accepts, in px along either side.
+ */
+#define MUX_MAX_CURSOR_SIZE 64
+
+/**
+ * @brief Bytes reserved for the cursor image, which is stored as a8r8g8b8 with rows packed to its width.
+ */
+#define MUX_SHM_CURSOR_SIZE (MUX_MAX_CURSOR_SIZE * MUX_MAX_CURSOR_SIZE * 4)
+
+/**
+ * @brief Offset of the first framebuffer slot from the start of the shared memory region.
+ */
+#define MUX_SHM_SLOT_OFFSET (MUX_SHM_HEADER_SIZE + MUX_SHM_CURSOR_SIZE)
+
+/**
+ * @brief Set in the shared memory header flags when the server doesn't need to acknowledge frames.
+ */
+#define MUX_SHM_FLAG_ACKLESS (1 << 0)
+
+/**
+ * @brief Set in the shared memory header flags when the hypervisor renders straight into slot 0. Reads from the slot
+ * may then see a frame that is still being rendered.
+ */
+#define MUX_SHM_FLAG_ZERO_COPY (1 << 1)
+
+/**
+ * @brief Per-slot part of the shared memory header.
+ *
+ * lock is a sequence lock. It is odd while the library is writing to the slot, and changes every time it does. A
+ * reader that sees the same even value before and after copying from the slot got a consistent frame.
+ */
+typedef struct MuxShmSlotHeader {
+    uint32_t lock;
+    /**
+     * @brief Sequence number of the frame in the slot.
+     */
+    uint32_t seq;
+    /**
+     * @brief Sequence number of the frame that rects are relative to.
+     */
+    uint32_t base_seq;
+    /**
+     * @brief Number of valid entries in rects.
+     */
+    uint32_t num_rects;
+    /**
+     * @brief Regions that changed since the frame base_seq. Unlike display updates, these include the destination
+     * of any copy, so readers of shared memory don't need to know about copies.
+     */
+    pixman_box32_t rects[MUX_MAX_DAMAGE_RECTS];
+} __attribute__((aligned(64))) MuxShmSlotHeader;
+
+/**
+ * @brief Cursor part of the shared memory header.
+ *
+ * lock is a sequence lock guarding both the fields after it and the cursor image.
+ */
+typedef struct MuxShmCursorHeader {
+    uint32_t lock;
+    /**
+     * @brief Serial number of the cursor image, or 0 if no cursor has been defined.
+     */
+    uint32_t serial;
+    uint32_t width;
+    uint32_t height;
+    uint32_t hot_x;
+    uint32_t hot_y;
+    /**
+     * @brief Position of the hotspot on the framebuffer.
+     */
+    int32_t x;
+    int32_t y;
+    uint32_t visible;
+} __attribute__((aligned(64))) MuxShmCursorHeader;
+
+/**
+ * @brief Header at the start of the shared memory region, describing the framebuffer to servers that read it
+ * without waiting for display updates.
+ *
+ * lock is a sequence lock guarding every field after it, except the slot and cursor headers, which have their own.
+ */
+typedef struct MuxShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t lock;
+    uint32_t flags;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint32_t num_slots;
+    /**
+     * @brief Index of the slot holding the most recent frame.
+     */
+    uint32_t latest_slot;
+    /**
+     * @brief Sequence number of the most recent frame.
+     */
+    uint32_t frame_seq;
+    uint32_t reserved;
+    /**
+     * @brief Offset of slot 0 from the start of the shared memory region.
+     */
+    uint64_t slot_offset;
+    uint64_t slot_size;
+    MuxShmSlotHeader slots[MUX_MAX_FRAMEBUFFER_SLOTS];
+    /**
+     * @brief Offset of the cursor image from the start of the shared memory region.
+     */
+    uint64_t cursor_offset;
+    MuxShmCursorHeader cursor;
+} MuxShmHeader;
+
 /**
  * @brief Main struct
  *
@@ -228,22 +729,142 @@ struct mux_display {
      * @brief File descriptor of the shared memory region.
      */
     int shmem_fd;
+    /**
+     * @brief Unix socket that shared memory file descriptors are passed to the server on, or -1 if the server
+     * opens the region by name.
+     */
+    int fd_socket;
+    /**
+     * @brief Generation of the shared memory region. Bumped every time a new file descriptor is handed to the server.
+     * Zero for the named region.
+     */
+    uint32_t shm_generation;
     /**
      * @brief pointer to the shared memory region.
      */
     void *shm_buffer;
     /**
-     * @brief Current dirty update
+     * @brief Size of the shared memory region in bytes.
+     */
+    size_t shm_size;
+    /**
+     * @brief Whether the shared memory region should be backed by transparent hugepages.
+     */
+    bool hugepages;
+    /**
+     * @brief Size the shared memory region shrinks to once the server acknowledges the display switch.
      */
-    MuxUpdate *dirty_update;
+    size_t shm_wanted_size;
     /**
-     * @brief Current outgoing update
+     * @brief Header at the start of the shared memory region.
      */
-    MuxUpdate *out_update;
+    MuxShmHeader *shm_header;
+    /**
+     * @brief Region of the framebuffer damaged since the last refresh. Guarded by damage_lock.
+     */
+    pixman_region32_t dirty_region;
+    /**
+     * @brief Lock guarding dirty_region, so damage can be reported while a refresh is copying.
+     */
+    pthread_mutex_t damage_lock;
+    /**
+     * @brief Lock held for the whole of a refresh or display switch, so the two never overlap when refreshes are
+     * driven by the library's refresh timer.
+     */
+    pthread_mutex_t refresh_lock;
+
+    /**
+     * @brief Framebuffer slots in the shared memory region. Slot states are guarded by shm_lock.
+     */
+    MuxFramebufferSlot slots[MUX_MAX_FRAMEBUFFER_SLOTS];
+    /**
+     * @brief Number of slots requested by the hypervisor.
+     */
+    int requested_slots;
+    /**
+     * @brief Number of slots in use for the current framebuffer.
+     */
+    int num_slots;
+    /**
+     * @brief Size of each slot in bytes.
+     */
+    size_t slot_size;
+    /**
+     * @brief Scanline of the framebuffer in each slot, in bytes.
+     */
+    int slot_stride;
+    /**
+     * @brief Index of the slot holding the most recent frame.
+     */
+    int latest_slot;
+    /**
+     * @brief Sequence number of the most recently published frame.
+     */
+    uint32_t frame_seq;
+    /**
+     * @brief Sequence number of the most recent display switch.
+     */
+    uint32_t switch_seq;
+    /**
+     * @brief Whether the current surface was created by mux_create_shared_surface(), and lives in slot 0.
+     */
+    bool zero_copy;
+    /**
+     * @brief Hashes of rectangles published from the shared surface. Since the server reads the surface directly,
+     * there's no previous frame to compare damage with, so these stand in for it.
+     */
+    MuxRectHash rect_hashes[MUX_RECT_HASH_ENTRIES];
+    /**
+     * @brief Number of valid entries in rect_hashes.
+     */
+    int num_rect_hashes;
+    /**
+     * @brief Entry of rect_hashes replaced next once it's full.
+     */
+    int next_rect_hash;
+    /**
+     * @brief Scratch space of mux_scroll_detect().
+     */
+    MuxScrollScratch scroll;
+    /**
+     * @brief Pixel format the server asked to read the framebuffer in, or 0 for the framebuffer's own format.
+     *
+     * Written by the mainloop thread when a FORMAT_REQUEST arrives, so it's only accessed atomically.
+     */
+    uint32_t requested_format;
+    /**
+     * @brief Set when requested_format changes, so that the next refresh switches the display over to it.
+     */
+    bool format_changed;
+    /**
+     * @brief Conversion applied while copying the current framebuffer into shared memory, or NULL if the shared
+     * memory region holds the framebuffer's own format.
+     */
+    const struct MuxConversion *conversion;
+    /**
+     * @brief Shape of the current cursor. A serial of 0 means no cursor has been defined.
+     */
+    cursor_define cursor;
+    /**
+     * @brief Position of the current cursor.
+     */
+    cursor_move cursor_pos;
+    /**
+     * @brief Whether the hypervisor asked for frames to be sent without waiting for acknowledgements.
+     */
+    bool requested_ackless;
+    /**
+     * @brief Whether frames of the current framebuffer are sent without waiting for acknowledgements.
+     */
+    bool ackless;
 
     struct {
         zsock_t *socket;
-        zpoller_t *poller;
+        /**
+         * @brief Frame holding the VM's UUID, which starts every outgoing message. Sent messages share its data.
+         */
+        zmq_msg_t identity;
+        MuxMsgBufferPool buffers;
         const char *path;
     } zmq;
 
@@ -253,21 +874,45 @@ struct mux_display {
     const char *uuid;
 
     /**
-     * @brief current framerate target of the VM guest. Comes from the server.
+     * @brief current framerate target of the VM guest. Comes from the server, and caps how often the pacing
+     * controller schedules refreshes. Written by the mainloop thread, so it's only accessed atomically.
      */
     uint32_t framerate;
+    MuxPacing pacing;
 
     /**
-     * @brief Condition variable associated with shared memory region.
+     * @brief The library's own refresh timer, started by mux_start_refresh_timer().
+     */
+    struct {
+        pthread_t thread;
+        bool running;
+        /**
+         * @brief timerfd armed for the next refresh, or -1.
+         */
+        int timer_fd;
+        /**
+         * @brief eventfd written to wake the refresh thread up, or -1.
+         */
+        int wake_fd;
+        /**
+         * @brief Set while the refresh thread is waiting for damage with no refresh scheduled. Only the first update
+         * to find it set writes to wake_fd, so bursts of damage cost a single wakeup.
+         */
+        bool idle;
+        bool stop;
+    } refresh_timer;
+
+    /**
+     * @brief Condition variable signaled when the server releases a slot.
      */
     pthread_cond_t shm_cond;
     /**
-     * @brief Lock guarding access to shared memory region.
+     * @brief Lock guarding the framebuffer slot bookkeeping.
      */
     pthread_mutex_t shm_lock;
 
     /**
-     * @brief Condition variable associated with outgoing update.
+     * @brief Condition variable signaled when a slot is ready to be sent.
      */
     pthread_cond_t update_cond;
 
@@ -281,6 +926,10 @@ struct mux_display {
      * @brief Outgoing message queue.
      */
     MuxMsgQueue outgoing_messages;
+    /**
+     * @brief Updates recycled through outgoing_messages.
+     */
+    MuxUpdatePool update_pool;
 };
 typedef struct mux_display MuxDisplay;
 
@@ -294,4 +943,6 @@ extern InputEventCallbacks callbacks;
  */
 extern MuxDisplay *display;
 
+void mux_refresh_timer_wake(void);
+
 #endif //SHIM_COMMON_H
@@ -0,0 +1,838 @@
+/** @file */
+#include <time.h>
+
+#include "framebuffer.h"
+#include "kernels.h"
+#include "workers.h"
+#include "pacing.h"
+
+/**
+ * @brief Cost model for scanline kernel calls, filled in by mux_framebuffer_calibrate().
+ *
+ * The defaults are only used until the library has been initialized.
+ */
+static struct {
+    /**
+     * @brief Fixed cost of a single kernel call, in ns.
+     */
+    double ns_per_call;
+    /**
+     * @brief Streaming cost per byte copied, in ns.
+     */
+    double ns_per_byte;
+} mux_copy_cost = { 20.0, 0.1 };
+
+/**
+ * @func Measures the cost of the copy kernels on this host and stores it in the cost model.
+ *
+ * The bandwidth is measured by copying a buffer much larger than the typical L2 cache, and the fixed per-call cost by
+ * copying many short, cache-hot runs. Each measurement keeps the best of a few attempts to filter out noise. This
+ * takes a few milliseconds and is meant to be run once during initialization.
+ */
+void mux_framebuffer_calibrate(void)
+{
+    const size_t size = 4 << 20;
+    const int calls = 16384;
+    const size_t run = 64;
+    int64_t best_bulk = INT64_MAX;
+    int64_t best_small = INT64_MAX;
+    int attempt, i;
+    uint8_t *src = g_malloc(size);
+    uint8_t *dst = g_malloc(size);
+
+    // fault both buffers in so page faults don't end up in the measurements.
+    memset(src, 1, size);
+    memset(dst, 0, size);
+
+    for (attempt = 0; attempt < 4; attempt++) {
+        int64_t start = mux_time_ns();
+        mux_kernels.copy(dst, src, size);
+        best_bulk = MIN(best_bulk, mux_time_ns() - start);
+
+        start = mux_time_ns();
+        for (i = 0; i < calls; i++) {
+            size_t offset = (i % 64) * run;
+            mux_kernels.copy(dst + offset, src + offset, run);
+        }
+        best_small = MIN(best_small, mux_time_ns() - start);
+    }
+
+    g_free(src);
+    g_free(dst);
+
+    if (best_bulk > 0) {
+        mux_copy_cost.ns_per_byte = (double) best_bulk / size;
+    }
+    // the short runs are cache-hot, so their time is dominated by the per-call overhead.
+    mux_copy_cost.ns_per_call = MAX(1.0, (double) best_small / calls);
+
+    mux_printf("Copy cost model: %.2f ns/call, %.1f MB/s", mux_copy_cost.ns_per_call,
+               1000.0 / mux_copy_cost.ns_per_byte);
+}
+
+/**
+ * @brief Framebuffer formats the library can share with the server. Pixels are copied and compared as opaque bytes,
+ * so all that matters is that every pixel takes up a whole number of bytes.
+ */
+static const pixman_format_code_t mux_supported_formats[] = {
+    PIXMAN_a8r8g8b8, PIXMAN_x8r8g8b8, PIXMAN_a8b8g8r8, PIXMAN_x8b8g8r8,
+    PIXMAN_b8g8r8a8, PIXMAN_b8g8r8x8, PIXMAN_r8g8b8a8, PIXMAN_r8g8b8x8,
+    PIXMAN_r8g8b8, PIXMAN_b8g8r8,
+    PIXMAN_r5g6b5, PIXMAN_b5g6r5, PIXMAN_a1r5g5b5, PIXMAN_x1r5g5b5,
+};
+
+/**
+ * @func Checks whether a framebuffer format can be shared with the server.
+ *
+ * @returns Whether the format is supported.
+ *
+ * @param format The pixman format code.
+ */
+bool mux_framebuffer_format_supported(pixman_format_code_t format)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(mux_supported_formats) / sizeof(mux_supported_formats[0]); i++) {
+        if (mux_supported_formats[i] == format) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @func Runs the 32bpp to r5g6b5 conversion kernel.
+ */
+static void mux_convert_565(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    mux_kernels.convert_565(dst, src, n);
+}
+
+/**
+ * @func Runs the red/blue swapping conversion kernel.
+ */
+static void mux_convert_swap_rb(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    mux_kernels.swap_rb(dst, src, n);
+}
+
+/**
+ * @brief Format conversions the library can do while copying the framebuffer into shared memory.
+ */
+static const MuxConversion mux_conversions[] = {
+    { PIXMAN_x8r8g8b8, PIXMAN_r5g6b5, mux_convert_565 },
+    { PIXMAN_a8r8g8b8, PIXMAN_r5g6b5, mux_convert_565 },
+    { PIXMAN_x8b8g8r8, PIXMAN_b5g6r5, mux_convert_565 },
+    { PIXMAN_a8b8g8r8, PIXMAN_b5g6r5, mux_convert_565 },
+    { PIXMAN_x8r8g8b8, PIXMAN_x8b8g8r8, mux_convert_swap_rb },
+    { PIXMAN_a8r8g8b8, PIXMAN_a8b8g8r8, mux_convert_swap_rb },
+    { PIXMAN_x8b8g8r8, PIXMAN_x8r8g8b8, mux_convert_swap_rb },
+    { PIXMAN_a8b8g8r8, PIXMAN_a8r8g8b8, mux_convert_swap_rb },
+};
+
+/**
+ * @func Looks up the conversion between two framebuffer formats.
+ *
+ * @returns The conversion, or NULL if the library can't convert between the two formats.
+ *
+ * @param from Format of the hypervisor's framebuffer.
+ * @param to Format the server wants to read.
+ */
+const MuxConversion *mux_framebuffer_find_conversion(pixman_format_code_t from, pixman_format_code_t to)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(mux_conversions) / sizeof(mux_conversions[0]); i++) {
+        if (mux_conversions[i].from == from && mux_conversions[i].to == to) {
+            return &mux_conversions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @func Copies a pixel region from one buffer to another. The two buffers are assumed to have the same subpixel
+ * layout and bpp. The function will transfer a given rectangle of certain dimension from the source buffer to
+ * a rectangle in the destination buffer with the same width and height, but not necessarily the same coordinates.
+ *
+ * @param dstData Pointer to the destination buffer. Assumed to be big enough to hold the data being copied into it.
+ * @param dstStep Scanline of dstData.
+ * @param xDst x-coordinate of the top-left corner of the destination rectangle.
+ * @param yDst y-coordinate of the top-left corner of the destination rectangle.
+ * @param width width of the rectangle in px.
+ * @param height height of the rectangle in px.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param xSrc x-coordinate of the top-left corner of the source rectangle.
+ * @param ySrc y-coordinate of the top-left corner of the source rectangle.
+ * @param bpp Bits per pixel of the two buffers.
+ */
+void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
+                     unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp)
+{
+	int lineSize;
+	int pixelSize;
+	unsigned char* pSrc;
+	unsigned char* pDst;
+	unsigned char* pEnd;
+	bool nt;
+
+	pixelSize = (bpp + 7) / 8;
+	lineSize = width * pixelSize;
+
+	pSrc = &srcData[(ySrc * srcStep) + (xSrc * pixelSize)];
+	pDst = &dstData[(yDst * dstStep) + (xDst * pixelSize)];
+
+    // large copies would only evict useful data from the cache, since
+    // the server reads the destination from another process anyway.
+    nt = (size_t) lineSize * height >= MUX_NT_COPY_MIN_BYTES;
+
+    // when the source and destination rectangles are both strips
+    // of the framebuffer spanning the full width, it's much cheaper
+    // to do one memcpy rather than going line-by-line.
+	if ((srcStep == dstStep) && (lineSize == srcStep)) {
+		(nt ? mux_kernels.copy_nt : mux_kernels.copy)(pDst, pSrc, lineSize * height);
+	} else if (nt) {
+		// non-temporal stores have to be fenced, which is only done once for the whole rectangle.
+		mux_kernels.copy_nt_rows(pDst, dstStep, pSrc, srcStep, lineSize, height);
+	} else {
+		pEnd = pSrc + (srcStep * height);
+
+		while (pSrc < pEnd) {
+			mux_kernels.copy(pDst, pSrc, lineSize);
+			pSrc += srcStep;
+			pDst += dstStep;
+		}
+	}
+}
+
+/**
+ * @func Converts a pixel region from one buffer into another.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param dstStep Scanline of dstData.
+ * @param x x-coordinate of the top-left corner of the rectangle in both buffers.
+ * @param y y-coordinate of the top-left corner of the rectangle in both buffers.
+ * @param width width of the rectangle in px.
+ * @param height height of the rectangle in px.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param conv The conversion from the source to the destination format.
+ */
+static void mux_convert_pixels(unsigned char *dstData, int dstStep, int x, int y, int width, int height,
+                               unsigned char *srcData, int srcStep, const MuxConversion *conv)
+{
+    int row;
+    int dstPixelSize = PIXMAN_FORMAT_BPP(conv->to) / 8;
+    int srcPixelSize = PIXMAN_FORMAT_BPP(conv->from) / 8;
+
+    for (row = y; row < y + height; row++) {
+        conv->convert(dstData + ((size_t) row * dstStep) + (x * dstPixelSize),
+                      srcData + ((size_t) row * srcStep) + (x * srcPixelSize), width);
+    }
+}
+
+/**
+ * @func Copies the pixels of a rectangle that differ between a source and a reference buffer, and computes the tight
+ * bounds of the pixels that differed. The destination and reference buffers are assumed to share the same scanline,
+ * subpixel layout and bpp. If a conversion is given, the source pixels are converted into the destination format,
+ * a chunk of pixels at a time, before being compared; otherwise the source buffer has the same layout too.
+ *
+ * @returns Whether any pixel of the rectangle differed between the source and reference buffers.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param refData Pointer to the reference buffer. May be the same as dstData.
+ * @param dstStep Scanline of the destination and reference buffers.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param x x-coordinate of the top-left corner of the rectangle.
+ * @param y y-coordinate of the top-left corner of the rectangle.
+ * @param width width of the rectangle in px.
+ * @param height height of the rectangle in px.
+ * @param bpp Bits per pixel of the destination and reference buffers.
+ * @param conv Conversion from the source format to the destination format, or NULL.
+ * @param bounds Set to the bounding box of the changed pixels, if there are any.
+ */
+bool mux_copy_compare_pixels(unsigned char *dstData, unsigned char *refData, int dstStep,
+                             unsigned char *srcData, int srcStep,
+                             int x, int y, int width, int height, int bpp, const MuxConversion *conv,
+                             pixman_box32_t *bounds)
+{
+    int row;
+    int pixelSize = (bpp + 7) / 8;
+    int srcPixelSize = conv ? PIXMAN_FORMAT_BPP(conv->from) / 8 : pixelSize;
+    int chunk = conv ? MUX_CONVERT_CHUNK_PIXELS : width;
+    size_t lineSize = width * pixelSize;
+    size_t lo = lineSize;
+    size_t hi = 0;
+    bool changed = false;
+    uint8_t scratch[MUX_CONVERT_CHUNK_PIXELS * 4] __attribute__((aligned(64)));
+
+    for (row = y; row < y + height; row++) {
+        size_t offset = ((size_t) row * dstStep) + (x * pixelSize);
+        unsigned char *pSrc = srcData + ((size_t) row * srcStep) + (x * srcPixelSize);
+        bool row_changed = false;
+        int px;
+
+        for (px = 0; px < width; px += chunk) {
+            int n = MIN(chunk, width - px);
+            const uint8_t *pChunk = pSrc + (px * pixelSize);
+            size_t first, last;
+
+            if (conv) {
+                conv->convert(scratch, pSrc + (px * srcPixelSize), n);
+                pChunk = scratch;
+            }
+
+            if (mux_kernels.copy_compare(dstData + offset + (px * pixelSize), refData + offset + (px * pixelSize),
+                                         pChunk, n * pixelSize, &first, &last)) {
+                row_changed = true;
+                lo = MIN(lo, (px * pixelSize) + first);
+                hi = MAX(hi, (px * pixelSize) + last);
+            }
+        }
+
+        if (row_changed) {
+            if (!changed) {
+                bounds->y1 = row;
+                changed = true;
+            }
+            bounds->y2 = row + 1;
+        }
+    }
+
+    if (changed) {
+        bounds->x1 = x + (lo / pixelSize);
+        bounds->x2 = x + ((hi + pixelSize - 1) / pixelSize);
+    }
+    return changed;
+}
+
+/**
+ * @func Finds the end of the y-band that a rectangle of a region starts. Regions store their rectangles in bands that
+ * span the same rows, sorted top to bottom.
+ *
+ * @returns Index of the first rectangle past the band.
+ *
+ * @param rects The rectangles of the region.
+ * @param i Index of the first rectangle of the band.
+ * @param n_rects Number of rectangles in the region.
+ */
+static int mux_band_end(pixman_box32_t *rects, int i, int n_rects)
+{
+    int j = i + 1;
+
+    while (j < n_rects && rects[j].y1 == rects[i].y1) {
+        j++;
+    }
+    return j;
+}
+
+/**
+ * @func Decides whether a band of rectangles is cheaper to process as whole scanlines, using the measured cost model.
+ *
+ * Going rectangle by rectangle only touches the bytes inside them, but costs a kernel call per row for every
+ * rectangle, or for every tile of it if it's processed tile by tile. Whole scanlines touch more bytes, but cover the
+ * entire band with one kernel call per row, or with a single call if the rows are contiguous in both buffers.
+ *
+ * @returns Whether the band should be widened to whole scanlines.
+ *
+ * @param rects The rectangles of the band, which all span the same rows.
+ * @param n Number of rectangles in the band.
+ * @param width Width of the framebuffer in px.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param tiled Whether rectangles are processed tile by tile.
+ * @param contiguous Whether whole scanlines can be processed with a single call.
+ */
+static bool mux_prefer_full_width(pixman_box32_t *rects, int n, int width, int pixelSize, bool tiled,
+                                  bool contiguous)
+{
+    int height = rects[0].y2 - rects[0].y1;
+    double partial = 0;
+    double full;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pixman_box32_t *r = &rects[i];
+        int calls = tiled ? ((r->x2 + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE) - (r->x1 / MUX_TILE_SIZE) : 1;
+
+        partial += height * ((calls * mux_copy_cost.ns_per_call) +
+                             ((r->x2 - r->x1) * pixelSize * mux_copy_cost.ns_per_byte));
+    }
+
+    full = (contiguous ? 1 : height) * mux_copy_cost.ns_per_call +
+           ((double) height * width * pixelSize * mux_copy_cost.ns_per_byte);
+    return full < partial;
+}
+
+/**
+ * @func Syncs one piece of a damaged rectangle and adds the bounds of the pixels that changed to the changed region.
+ */
+static void mux_sync_piece(unsigned char *dstData, unsigned char *refData, int dstStep,
+                           unsigned char *srcData, int srcStep, int bpp, const MuxConversion *conv,
+                           int x1, int y1, int x2, int y2, pixman_region32_t *changed)
+{
+    pixman_box32_t bounds;
+
+    if (mux_copy_compare_pixels(dstData, refData, dstStep, srcData, srcStep, x1, y1, x2 - x1, y2 - y1, bpp, conv,
+                                &bounds)) {
+        pixman_region32_union_rect(changed, changed, bounds.x1, bounds.y1,
+                                   bounds.x2 - bounds.x1, bounds.y2 - bounds.y1);
+    }
+}
+
+/**
+ * @func Syncs a damaged region on the calling thread. See mux_framebuffer_sync_region().
+ */
+static void mux_sync_region_serial(unsigned char *dstData, unsigned char *refData, int dstStep,
+                                   unsigned char *srcData, int srcStep, int width, int bpp,
+                                   const MuxConversion *conv, pixman_region32_t *damage, pixman_region32_t *changed)
+{
+    int i, j, end;
+    int n_rects;
+    int pixelSize = (bpp + 7) / 8;
+    pixman_box32_t *rects = pixman_region32_rectangles(damage, &n_rects);
+
+    for (i = 0; i < n_rects; i = end) {
+        // every rectangle of a band covers the same rows, so a band going full width only syncs them once.
+        bool full_width;
+        int tx, ty;
+
+        end = mux_band_end(rects, i, n_rects);
+        full_width = mux_prefer_full_width(&rects[i], end - i, width, pixelSize, true, false);
+
+        for (ty = rects[i].y1 - (rects[i].y1 % MUX_TILE_SIZE); ty < rects[i].y2; ty += MUX_TILE_SIZE) {
+            int y1 = MAX(ty, rects[i].y1);
+            int y2 = MIN(ty + MUX_TILE_SIZE, rects[i].y2);
+
+            if (full_width) {
+                mux_sync_piece(dstData, refData, dstStep, srcData, srcStep, bpp, conv, 0, y1, width, y2, changed);
+                continue;
+            }
+
+            for (j = i; j < end; j++) {
+                pixman_box32_t *r = &rects[j];
+
+                for (tx = r->x1 - (r->x1 % MUX_TILE_SIZE); tx < r->x2; tx += MUX_TILE_SIZE) {
+                    mux_sync_piece(dstData, refData, dstStep, srcData, srcStep, bpp, conv, MAX(tx, r->x1), y1,
+                                   MIN(tx + MUX_TILE_SIZE, r->x2), y2, changed);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Context shared by the bands of a parallel sync.
+ */
+typedef struct MuxSyncJob {
+    unsigned char *dstData;
+    unsigned char *refData;
+    int dstStep;
+    unsigned char *srcData;
+    int srcStep;
+    int width;
+    int bpp;
+    const MuxConversion *conv;
+    pixman_region32_t *damage;
+    /**
+     * @brief Changed region of every band. Regions can't be shared between threads, so they get merged afterwards.
+     */
+    pixman_region32_t changed[MUX_MAX_BANDS];
+} MuxSyncJob;
+
+/**
+ * @func Syncs the part of the damaged region that falls within one band.
+ */
+static void mux_sync_band(void *ctx, int band, int y1, int y2)
+{
+    MuxSyncJob *job = (MuxSyncJob *) ctx;
+    pixman_region32_t band_damage;
+
+    pixman_region32_init(&band_damage);
+    pixman_region32_intersect_rect(&band_damage, job->damage, 0, y1, job->width, y2 - y1);
+    mux_sync_region_serial(job->dstData, job->refData, job->dstStep, job->srcData, job->srcStep, job->width, job->bpp,
+                           job->conv, &band_damage, &job->changed[band]);
+    pixman_region32_fini(&band_damage);
+}
+
+/**
+ * @func Syncs a damaged region of the framebuffer into the destination buffer, skipping pixels that did not change.
+ *
+ * Hypervisors commonly report damage for pixels that were repainted with identical content. To avoid copying and
+ * transmitting those, the damaged region is split along a grid of MUX_TILE_SIZE square tiles and every damaged tile
+ * is compared against the reference buffer, which holds the last synced contents of the framebuffer. Only pixels
+ * that actually differ are copied, and only the tight bounds of the changed pixels in each tile end up in the changed
+ * region.
+ *
+ * Bands of rectangles that span most of the framebuffer width are cheaper to sync as whole scanlines, one row of
+ * tiles at a time; mux_prefer_full_width() decides which way each band goes.
+ *
+ * Large damage is split into horizontal bands that are synced in parallel by the copy worker pool.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param refData Pointer to the buffer holding the last synced contents of the framebuffer. May be the same as
+ * dstData.
+ * @param dstStep Scanline of the destination and reference buffers.
+ * @param srcData Pointer to the framebuffer.
+ * @param srcStep Scanline of the framebuffer.
+ * @param width Width of the framebuffer in px.
+ * @param bpp Bits per pixel of the destination and reference buffers.
+ * @param conv Conversion from the framebuffer format to the destination format, or NULL if they are the same.
+ * @param damage The damaged region. Must lie within the bounds of the framebuffer.
+ * @param changed Region that the pieces of damage that really changed are added to.
+ */
+void mux_framebuffer_sync_region(unsigned char *dstData, unsigned char *refData, int dstStep,
+                                 unsigned char *srcData, int srcStep, int width, int bpp,
+                                 const MuxConversion *conv, pixman_region32_t *damage, pixman_region32_t *changed)
+{
+    int i;
+    int n_rects;
+    int nbands;
+    size_t bytes = 0;
+    int pixelSize = (bpp + 7) / 8;
+    pixman_box32_t *extents = pixman_region32_extents(damage);
+    pixman_box32_t *rects = pixman_region32_rectangles(damage, &n_rects);
+    MuxSyncJob job;
+
+    for (i = 0; i < n_rects; i++) {
+        bytes += (size_t) (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1) * pixelSize;
+    }
+
+    nbands = mux_workers_plan_bands(extents->y1, extents->y2, bytes);
+    if (nbands <= 1) {
+        mux_sync_region_serial(dstData, refData, dstStep, srcData, srcStep, width, bpp, conv, damage, changed);
+        return;
+    }
+
+    job.dstData = dstData;
+    job.refData = refData;
+    job.dstStep = dstStep;
+    job.srcData = srcData;
+    job.srcStep = srcStep;
+    job.width = width;
+    job.bpp = bpp;
+    job.conv = conv;
+    job.damage = damage;
+    for (i = 0; i < MUX_MAX_BANDS; i++) {
+        pixman_region32_init(&job.changed[i]);
+    }
+
+    mux_workers_run_bands(extents->y1, extents->y2, nbands, mux_sync_band, &job);
+
+    for (i = 0; i < MUX_MAX_BANDS; i++) {
+        pixman_region32_union(changed, changed, &job.changed[i]);
+        pixman_region32_fini(&job.changed[i]);
+    }
+}
+
+/**
+ * @brief Context shared by the bands of a parallel copy.
+ */
+typedef struct MuxCopyJob {
+    unsigned char *dstData;
+    int dstStep;
+    unsigned char *srcData;
+    int srcStep;
+    /**
+     * @brief Width of the framebuffer in px.
+     */
+    int width;
+    int bpp;
+    const MuxConversion *conv;
+    /**
+     * @brief Region to copy, or NULL to copy whole scanlines.
+     */
+    pixman_region32_t *region;
+} MuxCopyJob;
+
+/**
+ * @func Copies a region on the calling thread. Bands of rectangles that are cheaper to copy as whole scanlines,
+ * according to the cost model, are widened to whole scanlines and copied once for the whole band.
+ */
+static void mux_copy_region_serial(unsigned char *dstData, int dstStep, unsigned char *srcData, int srcStep,
+                                   int width, int bpp, const MuxConversion *conv, pixman_region32_t *region)
+{
+    int i, j, end;
+    int n_rects;
+    int pixelSize = (bpp + 7) / 8;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &n_rects);
+    // whole scanlines only take a single call when neither buffer has padding at the end of its rows.
+    bool contiguous = dstStep == srcStep && dstStep == width * pixelSize;
+
+    // conversions go row by row anyway, so there's nothing to gain from widening the rectangles.
+    if (conv) {
+        for (i = 0; i < n_rects; i++) {
+            pixman_box32_t *r = &rects[i];
+            mux_convert_pixels(dstData, dstStep, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1, srcData, srcStep, conv);
+        }
+        return;
+    }
+
+    for (i = 0; i < n_rects; i = end) {
+        int height = rects[i].y2 - rects[i].y1;
+
+        end = mux_band_end(rects, i, n_rects);
+        if (mux_prefer_full_width(&rects[i], end - i, width, pixelSize, false, contiguous)) {
+            mux_copy_pixels(dstData, dstStep, 0, rects[i].y1, width, height, srcData, srcStep, 0, rects[i].y1, bpp);
+            continue;
+        }
+
+        for (j = i; j < end; j++) {
+            pixman_box32_t *r = &rects[j];
+            mux_copy_pixels(dstData, dstStep, r->x1, r->y1, r->x2 - r->x1, height, srcData, srcStep, r->x1, r->y1, bpp);
+        }
+    }
+}
+
+/**
+ * @func Copies the rows of one band.
+ */
+static void mux_copy_band(void *ctx, int band, int y1, int y2)
+{
+    MuxCopyJob *job = (MuxCopyJob *) ctx;
+    pixman_region32_t band_region;
+
+    if (job->region == NULL && job->conv != NULL) {
+        mux_convert_pixels(job->dstData, job->dstStep, 0, y1, job->width, y2 - y1, job->srcData, job->srcStep,
+                           job->conv);
+        return;
+    } else if (job->region == NULL) {
+        mux_copy_pixels(job->dstData, job->dstStep, 0, y1, job->width * ((job->bpp + 7) / 8), y2 - y1,
+                        job->srcData, job->srcStep, 0, y1, 8);
+        return;
+    }
+
+    pixman_region32_init(&band_region);
+    pixman_region32_intersect_rect(&band_region, job->region, 0, y1, job->width, y2 - y1);
+    mux_copy_region_serial(job->dstData, job->dstStep, job->srcData, job->srcStep, job->width, job->bpp, job->conv,
+                           &band_region);
+    pixman_region32_fini(&band_region);
+}
+
+/**
+ * @func Copies a region from one buffer to another, without comparing anything. Large regions are split into
+ * horizontal bands that are copied in parallel by the copy worker pool.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param dstStep Scanline of the destination buffer.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param width Width of the framebuffer in px.
+ * @param bpp Bits per pixel of the destination buffer.
+ * @param conv Conversion from the source format to the destination format, or NULL if they are the same.
+ * @param region The region to copy. Must lie within the bounds of both buffers.
+ */
+void mux_framebuffer_copy_region(unsigned char *dstData, int dstStep, unsigned char *srcData, int srcStep,
+                                 int width, int bpp, const MuxConversion *conv, pixman_region32_t *region)
+{
+    int i;
+    int n_rects;
+    size_t bytes = 0;
+    pixman_box32_t *extents = pixman_region32_extents(region);
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &n_rects);
+    MuxCopyJob job = { dstData, dstStep, srcData, srcStep, width, bpp, conv, region };
+
+    for (i = 0; i < n_rects; i++) {
+        bytes += (size_t) (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1) * ((bpp + 7) / 8);
+    }
+
+    mux_workers_run_bands(extents->y1, extents->y2, mux_workers_plan_bands(extents->y1, extents->y2, bytes),
+                          mux_copy_band, &job);
+}
+
+/**
+ * @func Copies whole scanlines from one buffer to another. Large copies are split into horizontal bands that are
+ * copied in parallel by the copy worker pool.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param dstStep Scanline of the destination buffer.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param width Width of the framebuffer in px.
+ * @param bpp Bits per pixel of the destination buffer.
+ * @param conv Conversion from the source format to the destination format, or NULL if they are the same.
+ * @param y1 First row to copy.
+ * @param y2 One past the last row to copy.
+ */
+void mux_framebuffer_copy_rows(unsigned char *dstData, int dstStep, unsigned char *srcData, int srcStep,
+                               int width, int bpp, const MuxConversion *conv, int y1, int y2)
+{
+    MuxCopyJob job = { dstData, dstStep, srcData, srcStep, width, bpp, conv, NULL };
+    int nbands = mux_workers_plan_bands(y1, y2, (size_t) width * ((bpp + 7) / 8) * (y2 - y1));
+
+    mux_workers_run_bands(y1, y2, nbands, mux_copy_band, &job);
+}
+
+/**
+ * @func Checks whether a rectangle is a single colour.
+ *
+ * @returns Whether every pixel in the rectangle has the same value.
+ *
+ * @param data Pointer to the buffer.
+ * @param step Scanline of the buffer.
+ * @param bpp Bits per pixel of the buffer.
+ * @param r The rectangle.
+ * @param colour Set to the value of the pixels if they're all the same.
+ */
+static bool mux_rect_is_solid(unsigned char *data, int step, int bpp, pixman_box32_t *r, uint32_t *colour)
+{
+    int row;
+    int pixelSize = (bpp + 7) / 8;
+    size_t lineSize = (size_t) (r->x2 - r->x1) * pixelSize;
+    unsigned char *first = data + ((size_t) r->y1 * step) + (r->x1 * pixelSize);
+
+    // a row is a single colour if it's equal to itself shifted by one pixel, whatever the pixel size.
+    if (mux_kernels.compare(first, first + pixelSize, lineSize - pixelSize) != lineSize - pixelSize) {
+        return false;
+    }
+
+    for (row = 1; row < r->y2 - r->y1; row++) {
+        if (mux_kernels.compare(first, first + ((size_t) row * step), lineSize) != lineSize) {
+            return false;
+        }
+    }
+
+    *colour = 0;
+    memcpy(colour, first, pixelSize);
+    return true;
+}
+
+/**
+ * @func Looks for large single-coloured rectangles in a region of a framebuffer, such as a cleared window, so that
+ * they can be sent as fills instead of pixels. The rectangles found are taken out of the region.
+ *
+ * @param data Pointer to the framebuffer.
+ * @param step Scanline of the framebuffer.
+ * @param bpp Bits per pixel of the framebuffer.
+ * @param region The region to look in. Must lie within the bounds of the framebuffer.
+ * @param fill Filled in with the solid rectangles and their colours.
+ */
+void mux_framebuffer_find_fills(unsigned char *data, int step, int bpp, pixman_region32_t *region, fill_update *fill)
+{
+    int i;
+    int n_rects;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &n_rects);
+    pixman_region32_t solid;
+
+    fill->num_rects = 0;
+    for (i = 0; i < n_rects && fill->num_rects < MUX_MAX_FILL_RECTS; i++) {
+        pixman_box32_t *r = &rects[i];
+
+        if ((r->x2 - r->x1) * (r->y2 - r->y1) < MUX_FILL_MIN_PIXELS) {
+            continue;
+        }
+
+        if (mux_rect_is_solid(data, step, bpp, r, &fill->colours[fill->num_rects])) {
+            fill->rects[fill->num_rects++] = *r;
+        }
+    }
+
+    if (fill->num_rects == 0) {
+        return;
+    }
+
+    // taking rectangles out of the region invalidates rects, so that happens once they've all been looked at.
+    pixman_region32_init(&solid);
+    for (i = 0; i < fill->num_rects; i++) {
+        pixman_box32_t *r = &fill->rects[i];
+        pixman_region32_union_rect(&solid, &solid, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+    }
+    pixman_region32_subtract(region, region, &solid);
+    pixman_region32_fini(&solid);
+}
+
+/**
+ * @brief Hashes the contents of a rectangle of a framebuffer.
+ *
+ * @param data Pointer to the framebuffer.
+ * @param step Scanline of the framebuffer.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param r The rectangle.
+ */
+static uint64_t mux_hash_rect(unsigned char *data, int step, int pixelSize, pixman_box32_t *r)
+{
+    int row;
+    uint64_t h = 0;
+    size_t lineSize = (size_t) (r->x2 - r->x1) * pixelSize;
+
+    for (row = r->y1; row < r->y2; row++) {
+        h = mux_kernels.hash(h, data + ((size_t) row * step) + (r->x1 * pixelSize), lineSize);
+    }
+    return h;
+}
+
+/**
+ * @brief Checks whether two rectangles overlap.
+ */
+static inline bool mux_boxes_overlap(pixman_box32_t *a, pixman_box32_t *b)
+{
+    return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/**
+ * @func Takes the rectangles out of a region whose contents hash the same as when they were last published, such as
+ * an animated cursor redrawn in place, and remembers the hashes of the rest. Meant for surfaces the server reads
+ * directly, where there's no previous frame to compare the damage with.
+ *
+ * The remaining rectangles are assumed to be published, so the hashes of remembered rectangles they overlap are
+ * forgotten.
+ *
+ * @param data Pointer to the framebuffer.
+ * @param step Scanline of the framebuffer.
+ * @param bpp Bits per pixel of the framebuffer.
+ * @param region The region to check. Must lie within the bounds of the framebuffer.
+ */
+void mux_framebuffer_drop_duplicates(unsigned char *data, int step, int bpp, pixman_region32_t *region)
+{
+    int i, j, match;
+    int n_rects;
+    int pixelSize = (bpp + 7) / 8;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &n_rects);
+    MuxRectHash *entries = display->rect_hashes;
+    pixman_region32_t same;
+
+    pixman_region32_init(&same);
+    for (i = 0; i < n_rects; i++) {
+        pixman_box32_t *r = &rects[i];
+        uint64_t h = mux_hash_rect(data, step, pixelSize, r);
+
+        match = -1;
+        for (j = 0; j < display->num_rect_hashes; j++) {
+            if (memcmp(&entries[j].box, r, sizeof(*r)) == 0) {
+                match = j;
+                break;
+            }
+        }
+
+        if (match >= 0 && entries[match].hash == h) {
+            pixman_region32_union_rect(&same, &same, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+            continue;
+        }
+
+        // the server is about to see new contents under any other rectangle this one overlaps.
+        for (j = 0; j < display->num_rect_hashes; j++) {
+            if (j != match && mux_boxes_overlap(&entries[j].box, r)) {
+                entries[j].box = (pixman_box32_t) { 0, 0, 0, 0 };
+            }
+        }
+
+        if (match < 0) {
+            if (display->num_rect_hashes < MUX_RECT_HASH_ENTRIES) {
+                match = display->num_rect_hashes++;
+            } else {
+                match = display->next_rect_hash;
+                display->next_rect_hash = (display->next_rect_hash + 1) % MUX_RECT_HASH_ENTRIES;
+            }
+            entries[match].box = *r;
+        }
+        entries[match].hash = h;
+    }
+
+    // taking rectangles out of the region invalidates rects, so that happens once they've all been looked at.
+    if (pixman_region32_not_empty(&same)) {
+        mux_printf("Dropping %d rects of damage that didn't change", pixman_region32_n_rects(&same));
+        pixman_region32_subtract(region, region, &same);
+    }
+    pixman_region32_fini(&same);
+}
@@ -0,0 +1,52 @@
+#ifndef SHIM_FRAMEBUFFER_H
+#define SHIM_FRAMEBUFFER_H
+
+#include "common.h"
+
+/**
+ * @brief Edge length in px of the tiles the framebuffer is divided into when looking for changed pixels.
+ */
+#define MUX_TILE_SIZE 64
+
+/**
+ * @brief Number of pixels converted at a time into the scratch buffer when comparing converted pixels.
+ */
+#define MUX_CONVERT_CHUNK_PIXELS 256
+
+/**
+ * @brief Smallest area in px of a single-coloured rectangle that is sent as a fill rather than as pixels.
+ */
+#define MUX_FILL_MIN_PIXELS 4096
+
+/**
+ * @brief A conversion between two framebuffer formats.
+ */
+typedef struct MuxConversion {
+    pixman_format_code_t from;
+    pixman_format_code_t to;
+    /**
+     * @brief Converts n pixels from src into dst.
+     */
+    void (*convert)(uint8_t *dst, const uint8_t *src, size_t n);
+} MuxConversion;
+
+void mux_framebuffer_calibrate(void);
+bool mux_framebuffer_format_supported(pixman_format_code_t format);
+const MuxConversion *mux_framebuffer_find_conversion(pixman_format_code_t from, pixman_format_code_t to);
+void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
+                     unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp);
+bool mux_copy_compare_pixels(unsigned char *dstData, unsigned char *refData, int dstStep,
+                             unsigned char *srcData, int srcStep,
+                             int x, int y, int width, int height, int bpp, const MuxConversion *conv,
+                             pixman_box32_t *bounds);
+void mux_framebuffer_sync_region(unsigned char *dstData, unsigned char *refData, int dstStep,
+                                 unsigned char *srcData, int srcStep, int width, int bpp,
+                                 const MuxConversion *conv, pixman_region32_t *damage, pixman_region32_t *changed);
+void mux_framebuffer_copy_region(unsigned char *dstData, int dstStep, unsigned char *srcData, int srcStep,
+                                 int width, int bpp, const MuxConversion *conv, pixman_region32_t *region);
+void mux_framebuffer_copy_rows(unsigned char *dstData, int dstStep, unsigned char *srcData, int srcStep,
+                               int width, int bpp, const MuxConversion *conv, int y1, int y2);
+void mux_framebuffer_find_fills(unsigned char *data, int step, int bpp, pixman_region32_t *region, fill_update *fill);
+void mux_framebuffer_drop_duplicates(unsigned char *data, int step, int bpp, pixman_region32_t *region);
+
+#endif //SHIM_FRAMEBUFFER_H
@@ -0,0 +1,766 @@
+/** @file */
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MUX_KERNELS_X86
+#endif
+
+/*
+ * Generic kernels
+ */
+
+/**
+ * @brief Finishes a copy_compare pass one byte at a time. Shared by all implementations to deal with the bytes left
+ * over at the end of a scanline.
+ *
+ * @param dst Destination buffer.
+ * @param ref Reference buffer that src is compared against.
+ * @param src Source buffer.
+ * @param i Offset to start at.
+ * @param len Length of both buffers.
+ * @param first Offset of the first differing byte. Only written if no difference has been found yet.
+ * @param last One past the offset of the last differing byte so far, or 0 if no difference has been found yet.
+ */
+static inline void mux_copy_compare_tail(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t i, size_t len,
+                                         size_t *first, size_t *last)
+{
+    for (; i < len; i++) {
+        if (ref[i] != src[i]) {
+            dst[i] = src[i];
+            if (*last == 0) {
+                *first = i;
+            }
+            *last = i + 1;
+        }
+    }
+}
+
+static void mux_copy_generic(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+static void mux_copy_rows_generic(uint8_t *dst, size_t dstStep, const uint8_t *src, size_t srcStep, size_t len,
+                                  size_t rows)
+{
+    size_t row;
+
+    for (row = 0; row < rows; row++) {
+        memcpy(dst + (row * dstStep), src + (row * srcStep), len);
+    }
+}
+
+static size_t mux_compare_generic(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) {
+            return i + (__builtin_ctzll(x ^ y) / 8);
+        }
+    }
+
+    for (; i < len; i++) {
+        if (a[i] != b[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+static bool mux_copy_compare_generic(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t len,
+                                     size_t *first, size_t *last)
+{
+    size_t i = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t s, r, diff;
+        memcpy(&s, src + i, sizeof(s));
+        memcpy(&r, ref + i, sizeof(r));
+        diff = s ^ r;
+        if (diff) {
+            memcpy(dst + i, &s, sizeof(s));
+            if (hi == 0) {
+                lo = i + (__builtin_ctzll(diff) / 8);
+            }
+            hi = i + sizeof(uint64_t) - (__builtin_clzll(diff) / 8);
+        }
+    }
+    mux_copy_compare_tail(dst, ref, src, i, len, &lo, &hi);
+
+    if (hi == 0) {
+        return false;
+    }
+    *first = lo;
+    *last = hi;
+    return true;
+}
+
+/**
+ * @brief Packs one x8r8g8b8 pixel into r5g6b5.
+ */
+static inline uint16_t mux_pack_565(uint32_t p)
+{
+    return ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+}
+
+/**
+ * @brief Swaps the first and third byte of one 32bpp pixel.
+ */
+static inline uint32_t mux_swap_rb(uint32_t p)
+{
+    return (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+}
+
+static void mux_convert_565_generic(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t p;
+        uint16_t q;
+        memcpy(&p, src + (i * 4), sizeof(p));
+        q = mux_pack_565(p);
+        memcpy(dst + (i * 2), &q, sizeof(q));
+    }
+}
+
+static void mux_swap_rb_generic(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t p;
+        memcpy(&p, src + (i * 4), sizeof(p));
+        p = mux_swap_rb(p);
+        memcpy(dst + (i * 4), &p, sizeof(p));
+    }
+}
+
+/*
+ * The hash kernels follow the structure of XXH3: four 64-bit accumulators each take a multiply of the two 32-bit
+ * halves of a key-mixed input word, and the raw word of their neighbour, which vectorizes into one 32x32->64 multiply
+ * per lane. The generic and SIMD versions only differ in how the stripes are consumed; the setup and the final mix are
+ * shared, so they produce the same hashes.
+ */
+
+static const uint64_t mux_hash_keys[4] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+};
+
+#define MUX_PRIME32_1 0x9e3779b1U
+#define MUX_PRIME64_1 0x9e3779b185ebca87ULL
+#define MUX_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define MUX_PRIME64_3 0x165667b19e3779f9ULL
+#define MUX_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define MUX_PRIME64_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t mux_rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+/**
+ * @brief Sets up the hash accumulators for a new span.
+ */
+static inline void mux_hash_init(uint64_t acc[4], uint64_t seed)
+{
+    acc[0] = MUX_PRIME32_1 + seed;
+    acc[1] = MUX_PRIME64_1 - seed;
+    acc[2] = MUX_PRIME64_2 + seed;
+    acc[3] = MUX_PRIME64_3 - seed;
+}
+
+/**
+ * @brief Mixes the accumulators and the bytes that don't fill a whole stripe into the final hash.
+ *
+ * @param acc The accumulators.
+ * @param p Start of the span.
+ * @param i Offset of the first byte the stripe loop didn't consume.
+ * @param len Length of the span.
+ */
+static inline uint64_t mux_hash_finish(const uint64_t acc[4], const uint8_t *p, size_t i, size_t len)
+{
+    uint64_t h = len * MUX_PRIME64_5;
+    uint64_t v;
+    int j;
+
+    for (j = 0; j < 4; j++) {
+        h ^= mux_rotl64(acc[j] * MUX_PRIME64_2, 31) * MUX_PRIME64_1;
+        h = (mux_rotl64(h, 27) * MUX_PRIME64_1) + MUX_PRIME64_4;
+    }
+    for (; i + sizeof(v) <= len; i += sizeof(v)) {
+        memcpy(&v, p + i, sizeof(v));
+        h ^= mux_rotl64(v * MUX_PRIME64_2, 31) * MUX_PRIME64_1;
+        h = (mux_rotl64(h, 27) * MUX_PRIME64_1) + MUX_PRIME64_4;
+    }
+    if (i < len) {
+        v = 0;
+        memcpy(&v, p + i, len - i);
+        h ^= v * MUX_PRIME64_5;
+        h = mux_rotl64(h, 11) * MUX_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= MUX_PRIME64_2;
+    h ^= h >> 29;
+    h *= MUX_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t mux_hash_generic(uint64_t seed, const uint8_t *p, size_t len)
+{
+    uint64_t acc[4];
+    uint64_t d[4];
+    size_t i = 0, stripes = 0;
+    int j;
+
+    mux_hash_init(acc, seed);
+    for (; i + MUX_HASH_STRIPE <= len; i += MUX_HASH_STRIPE) {
+        memcpy(d, p + i, sizeof(d));
+        for (j = 0; j < 4; j++) {
+            uint64_t k = d[j] ^ mux_hash_keys[j];
+            acc[j ^ 1] += d[j];
+            acc[j] += (k & 0xffffffff) * (k >> 32);
+        }
+        if (++stripes % MUX_HASH_BLOCK_STRIPES == 0) {
+            for (j = 0; j < 4; j++) {
+                acc[j] = ((acc[j] ^ (acc[j] >> 47)) ^ mux_hash_keys[j]) * MUX_PRIME32_1;
+            }
+        }
+    }
+    return mux_hash_finish(acc, p, i, len);
+}
+
+#ifdef MUX_KERNELS_X86
+
+/*
+ * SSE2 kernels
+ */
+
+__attribute__((target("sse2")))
+static void mux_copy_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + i + 48));
+        _mm_storeu_si128((__m128i *) (dst + i), a);
+        _mm_storeu_si128((__m128i *) (dst + i + 16), b);
+        _mm_storeu_si128((__m128i *) (dst + i + 32), c);
+        _mm_storeu_si128((__m128i *) (dst + i + 48), d);
+    }
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t mux_compare_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *) (b + i));
+        unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + mux_compare_generic(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static bool mux_copy_compare_sse2(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t len,
+                                  size_t *first, size_t *last)
+{
+    size_t i = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i r = _mm_loadu_si128((const __m128i *) (ref + i));
+        unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(s, r)) & 0xFFFF;
+        if (mask) {
+            _mm_storeu_si128((__m128i *) (dst + i), s);
+            if (hi == 0) {
+                lo = i + __builtin_ctz(mask);
+            }
+            hi = i + 32 - __builtin_clz(mask);
+        }
+    }
+    mux_copy_compare_tail(dst, ref, src, i, len, &lo, &hi);
+
+    if (hi == 0) {
+        return false;
+    }
+    *first = lo;
+    *last = hi;
+    return true;
+}
+
+/**
+ * @brief Packs four x8r8g8b8 pixels into r5g6b5, leaving each result sign-extended in its 32-bit lane so that it
+ * survives _mm_packs_epi32().
+ */
+__attribute__((target("sse2")))
+static inline __m128i mux_pack_565_sse2(__m128i p)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+    __m128i q = _mm_or_si128(_mm_or_si128(r, g), b);
+
+    return _mm_srai_epi32(_mm_slli_epi32(q, 16), 16);
+}
+
+__attribute__((target("sse2")))
+static void mux_convert_565_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = mux_pack_565_sse2(_mm_loadu_si128((const __m128i *) (src + (i * 4))));
+        __m128i b = mux_pack_565_sse2(_mm_loadu_si128((const __m128i *) (src + (i * 4) + 16)));
+        _mm_storeu_si128((__m128i *) (dst + (i * 2)), _mm_packs_epi32(a, b));
+    }
+    mux_convert_565_generic(dst + (i * 2), src + (i * 4), n - i);
+}
+
+__attribute__((target("sse2")))
+static void mux_swap_rb_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *) (src + (i * 4)));
+        __m128i ga = _mm_and_si128(p, _mm_set1_epi32(0xFF00FF00));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0xFF));
+        __m128i b = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xFF)), 16);
+        _mm_storeu_si128((__m128i *) (dst + (i * 4)), _mm_or_si128(ga, _mm_or_si128(r, b)));
+    }
+    mux_swap_rb_generic(dst + (i * 4), src + (i * 4), n - i);
+}
+
+/**
+ * @brief Copies bytes with regular stores until dst is aligned to align bytes.
+ *
+ * @returns The number of bytes copied.
+ */
+static inline size_t mux_copy_align_head(uint8_t *dst, const uint8_t *src, size_t len, size_t align)
+{
+    size_t head = (align - ((uintptr_t) dst & (align - 1))) & (align - 1);
+
+    head = MIN(head, len);
+    memcpy(dst, src, head);
+    return head;
+}
+
+__attribute__((target("sse2")))
+static inline void mux_stream_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = mux_copy_align_head(dst, src, len, 16);
+
+    for (; i + 64 <= len; i += 64) {
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE), _MM_HINT_NTA);
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + i + 48));
+        _mm_stream_si128((__m128i *) (dst + i), a);
+        _mm_stream_si128((__m128i *) (dst + i + 16), b);
+        _mm_stream_si128((__m128i *) (dst + i + 32), c);
+        _mm_stream_si128((__m128i *) (dst + i + 48), d);
+    }
+    for (; i + 16 <= len; i += 16) {
+        _mm_stream_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void mux_copy_nt_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    mux_stream_sse2(dst, src, len);
+    _mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static void mux_copy_nt_rows_sse2(uint8_t *dst, size_t dstStep, const uint8_t *src, size_t srcStep, size_t len,
+                                  size_t rows)
+{
+    size_t row;
+
+    for (row = 0; row < rows; row++) {
+        mux_stream_sse2(dst + (row * dstStep), src + (row * srcStep), len);
+    }
+    _mm_sfence();
+}
+
+/*
+ * AVX2 kernels
+ */
+
+__attribute__((target("avx2")))
+static void mux_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (src + i + 96));
+        _mm256_storeu_si256((__m256i *) (dst + i), a);
+        _mm256_storeu_si256((__m256i *) (dst + i + 32), b);
+        _mm256_storeu_si256((__m256i *) (dst + i + 64), c);
+        _mm256_storeu_si256((__m256i *) (dst + i + 96), d);
+    }
+    for (; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_loadu_si256((const __m256i *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline void mux_stream_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = mux_copy_align_head(dst, src, len, 32);
+
+    for (; i + 128 <= len; i += 128) {
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE), _MM_HINT_NTA);
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE + 64), _MM_HINT_NTA);
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (src + i + 96));
+        _mm256_stream_si256((__m256i *) (dst + i), a);
+        _mm256_stream_si256((__m256i *) (dst + i + 32), b);
+        _mm256_stream_si256((__m256i *) (dst + i + 64), c);
+        _mm256_stream_si256((__m256i *) (dst + i + 96), d);
+    }
+    for (; i + 32 <= len; i += 32) {
+        _mm256_stream_si256((__m256i *) (dst + i), _mm256_loadu_si256((const __m256i *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void mux_copy_nt_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    mux_stream_avx2(dst, src, len);
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void mux_copy_nt_rows_avx2(uint8_t *dst, size_t dstStep, const uint8_t *src, size_t srcStep, size_t len,
+                                  size_t rows)
+{
+    size_t row;
+
+    for (row = 0; row < rows; row++) {
+        mux_stream_avx2(dst + (row * dstStep), src + (row * srcStep), len);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static size_t mux_compare_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + mux_compare_generic(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool mux_copy_compare_avx2(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t len,
+                                  size_t *first, size_t *last)
+{
+    size_t i = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i r = _mm256_loadu_si256((const __m256i *) (ref + i));
+        unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(s, r));
+        if (mask) {
+            _mm256_storeu_si256((__m256i *) (dst + i), s);
+            if (hi == 0) {
+                lo = i + __builtin_ctz(mask);
+            }
+            hi = i + 32 - __builtin_clz(mask);
+        }
+    }
+    mux_copy_compare_tail(dst, ref, src, i, len, &lo, &hi);
+
+    if (hi == 0) {
+        return false;
+    }
+    *first = lo;
+    *last = hi;
+    return true;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mux_pack_565_avx2(__m256i p)
+{
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xF800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07E0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001F));
+    __m256i q = _mm256_or_si256(_mm256_or_si256(r, g), b);
+
+    return _mm256_srai_epi32(_mm256_slli_epi32(q, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void mux_convert_565_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = mux_pack_565_avx2(_mm256_loadu_si256((const __m256i *) (src + (i * 4))));
+        __m256i b = mux_pack_565_avx2(_mm256_loadu_si256((const __m256i *) (src + (i * 4) + 32)));
+        // packs works within 128-bit lanes, so the middle quadwords come out swapped.
+        __m256i q = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + (i * 2)), q);
+    }
+    mux_convert_565_sse2(dst + (i * 2), src + (i * 4), n - i);
+}
+
+__attribute__((target("avx2")))
+static void mux_swap_rb_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (src + (i * 4)));
+        _mm256_storeu_si256((__m256i *) (dst + (i * 4)), _mm256_shuffle_epi8(p, shuffle));
+    }
+    mux_swap_rb_generic(dst + (i * 4), src + (i * 4), n - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t mux_hash_avx2(uint64_t seed, const uint8_t *p, size_t len)
+{
+    uint64_t acc[4];
+    size_t i = 0, stripes = 0;
+    __m256i a, d, k;
+    const __m256i keys = _mm256_loadu_si256((const __m256i *) mux_hash_keys);
+    const __m256i prime = _mm256_set1_epi64x(MUX_PRIME32_1);
+
+    mux_hash_init(acc, seed);
+    a = _mm256_loadu_si256((const __m256i *) acc);
+    for (; i + MUX_HASH_STRIPE <= len; i += MUX_HASH_STRIPE) {
+        d = _mm256_loadu_si256((const __m256i *) (p + i));
+        k = _mm256_xor_si256(d, keys);
+        // the shuffle swaps neighbouring 64-bit words, so every accumulator also takes its neighbour's raw input.
+        a = _mm256_add_epi64(a, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = _mm256_add_epi64(a, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32)));
+
+        if (++stripes % MUX_HASH_BLOCK_STRIPES == 0) {
+            a = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_srli_epi64(a, 47)), keys);
+            // 64x32-bit multiply, in two halves.
+            a = _mm256_add_epi64(_mm256_mul_epu32(a, prime),
+                                 _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime), 32));
+        }
+    }
+    _mm256_storeu_si256((__m256i *) acc, a);
+    return mux_hash_finish(acc, p, i, len);
+}
+
+/*
+ * AVX-512 kernels
+ */
+
+__attribute__((target("avx512f,avx512bw")))
+static void mux_copy_avx512(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 256 <= len; i += 256) {
+        __m512i a = _mm512_loadu_si512((const void *) (src + i));
+        __m512i b = _mm512_loadu_si512((const void *) (src + i + 64));
+        __m512i c = _mm512_loadu_si512((const void *) (src + i + 128));
+        __m512i d = _mm512_loadu_si512((const void *) (src + i + 192));
+        _mm512_storeu_si512((void *) (dst + i), a);
+        _mm512_storeu_si512((void *) (dst + i + 64), b);
+        _mm512_storeu_si512((void *) (dst + i + 128), c);
+        _mm512_storeu_si512((void *) (dst + i + 192), d);
+    }
+    for (; i + 64 <= len; i += 64) {
+        _mm512_storeu_si512((void *) (dst + i), _mm512_loadu_si512((const void *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void mux_stream_avx512(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = mux_copy_align_head(dst, src, len, 64);
+
+    for (; i + 256 <= len; i += 256) {
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE), _MM_HINT_NTA);
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE + 64), _MM_HINT_NTA);
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE + 128), _MM_HINT_NTA);
+        _mm_prefetch((const char *) (src + i + MUX_PREFETCH_DISTANCE + 192), _MM_HINT_NTA);
+        __m512i a = _mm512_loadu_si512((const void *) (src + i));
+        __m512i b = _mm512_loadu_si512((const void *) (src + i + 64));
+        __m512i c = _mm512_loadu_si512((const void *) (src + i + 128));
+        __m512i d = _mm512_loadu_si512((const void *) (src + i + 192));
+        _mm512_stream_si512((void *) (dst + i), a);
+        _mm512_stream_si512((void *) (dst + i + 64), b);
+        _mm512_stream_si512((void *) (dst + i + 128), c);
+        _mm512_stream_si512((void *) (dst + i + 192), d);
+    }
+    for (; i + 64 <= len; i += 64) {
+        _mm512_stream_si512((void *) (dst + i), _mm512_loadu_si512((const void *) (src + i)));
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mux_copy_nt_avx512(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    mux_stream_avx512(dst, src, len);
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mux_copy_nt_rows_avx512(uint8_t *dst, size_t dstStep, const uint8_t *src, size_t srcStep, size_t len,
+                                    size_t rows)
+{
+    size_t row;
+
+    for (row = 0; row < rows; row++) {
+        mux_stream_avx512(dst + (row * dstStep), src + (row * srcStep), len);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t mux_compare_avx512(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void *) (a + i));
+        __m512i y = _mm512_loadu_si512((const void *) (b + i));
+        __mmask64 mask = _mm512_cmpneq_epi8_mask(x, y);
+        if (mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+    return i + mux_compare_generic(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool mux_copy_compare_avx512(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t len,
+                                    size_t *first, size_t *last)
+{
+    size_t i = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i s = _mm512_loadu_si512((const void *) (src + i));
+        __m512i r = _mm512_loadu_si512((const void *) (ref + i));
+        __mmask64 mask = _mm512_cmpneq_epi8_mask(s, r);
+        if (mask) {
+            _mm512_storeu_si512((void *) (dst + i), s);
+            if (hi == 0) {
+                lo = i + __builtin_ctzll(mask);
+            }
+            hi = i + 64 - __builtin_clzll(mask);
+        }
+    }
+    mux_copy_compare_tail(dst, ref, src, i, len, &lo, &hi);
+
+    if (hi == 0) {
+        return false;
+    }
+    *first = lo;
+    *last = hi;
+    return true;
+}
+
+#endif // MUX_KERNELS_X86
+
+MuxKernels mux_kernels = {
+    .name = "generic",
+    .copy = mux_copy_generic,
+    .copy_nt = mux_copy_generic,
+    .copy_nt_rows = mux_copy_rows_generic,
+    .compare = mux_compare_generic,
+    .copy_compare = mux_copy_compare_generic,
+    .convert_565 = mux_convert_565_generic,
+    .swap_rb = mux_swap_rb_generic,
+    .hash = mux_hash_generic,
+};
+
+/**
+ * @brief Picks the best set of kernels for the host CPU. Runs once when the library is loaded.
+ */
+__attribute__((constructor))
+static void mux_kernels_init(void)
+{
+#ifdef MUX_KERNELS_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512bw")) {
+        mux_kernels.name = "avx512";
+        mux_kernels.copy = mux_copy_avx512;
+        mux_kernels.copy_nt = mux_copy_nt_avx512;
+        mux_kernels.copy_nt_rows = mux_copy_nt_rows_avx512;
+        mux_kernels.compare = mux_compare_avx512;
+        mux_kernels.copy_compare = mux_copy_compare_avx512;
+        // conversions and hashing are bound by memory bandwidth well before AVX2 runs out of steam.
+        mux_kernels.convert_565 = mux_convert_565_avx2;
+        mux_kernels.swap_rb = mux_swap_rb_avx2;
+        mux_kernels.hash = mux_hash_avx2;
+    } else if (__builtin_cpu_supports("avx2")) {
+        mux_kernels.name = "avx2";
+        mux_kernels.copy = mux_copy_avx2;
+        mux_kernels.copy_nt = mux_copy_nt_avx2;
+        mux_kernels.copy_nt_rows = mux_copy_nt_rows_avx2;
+        mux_kernels.compare = mux_compare_avx2;
+        mux_kernels.copy_compare = mux_copy_compare_avx2;
+        mux_kernels.convert_565 = mux_convert_565_avx2;
+        mux_kernels.swap_rb = mux_swap_rb_avx2;
+        mux_kernels.hash = mux_hash_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        mux_kernels.name = "sse2";
+        mux_kernels.copy = mux_copy_sse2;
+        mux_kernels.copy_nt = mux_copy_nt_sse2;
+        mux_kernels.copy_nt_rows = mux_copy_nt_rows_sse2;
+        mux_kernels.compare = mux_compare_sse2;
+        mux_kernels.copy_compare = mux_copy_compare_sse2;
+        mux_kernels.convert_565 = mux_convert_565_sse2;
+        mux_kernels.swap_rb = mux_swap_rb_sse2;
+    }
+#endif
+    mux_printf("Using %s framebuffer kernels", mux_kernels.name);
+}
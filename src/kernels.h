@@ -0,0 +1,88 @@
+#ifndef SHIM_KERNELS_H
+#define SHIM_KERNELS_H
+
+#include "common.h"
+
+/**
+ * @brief Copies touching at least this many bytes in total use the non-temporal copy kernel.
+ *
+ * Below this size, the written data is likely to still be in the cache by the time the server reads it, and the
+ * regular kernel is faster.
+ */
+#define MUX_NT_COPY_MIN_BYTES (256 * 1024)
+
+/**
+ * @brief Distance in bytes ahead of the current position that the non-temporal copy kernels prefetch the source from.
+ */
+#define MUX_PREFETCH_DISTANCE 512
+
+/**
+ * @brief Number of bytes the hash kernels consume per step, spread over four 64-bit accumulators.
+ */
+#define MUX_HASH_STRIPE 32
+
+/**
+ * @brief Number of stripes after which the hash accumulators are scrambled, so that no input bits get lost to the
+ * multiplications over long spans.
+ */
+#define MUX_HASH_BLOCK_STRIPES 32
+
+/**
+ * @brief Set of scanline kernels used to move pixels around.
+ *
+ * All kernels operate on a run of bytes within a single scanline. The best implementation for the host CPU is picked
+ * once when the library is loaded and stored in mux_kernels.
+ */
+typedef struct MuxKernels {
+    /**
+     * @brief Name of the instruction set the kernels are written for.
+     */
+    const char *name;
+    /**
+     * @brief Copies len bytes from src to dst.
+     */
+    void (*copy)(uint8_t *dst, const uint8_t *src, size_t len);
+    /**
+     * @brief Copies len bytes from src to dst with non-temporal stores, so that dst doesn't get pulled into the cache.
+     * Meant for large copies into memory that is read by another process.
+     */
+    void (*copy_nt)(uint8_t *dst, const uint8_t *src, size_t len);
+    /**
+     * @brief Copies rows rows of len bytes each from src to dst with non-temporal stores, like copy_nt, but only waits
+     * for the stores to complete once after the last row.
+     */
+    void (*copy_nt_rows)(uint8_t *dst, size_t dstStep, const uint8_t *src, size_t srcStep, size_t len, size_t rows);
+    /**
+     * @brief Returns the offset of the first byte that differs between a and b, or len if they are equal.
+     */
+    size_t (*compare)(const uint8_t *a, const uint8_t *b, size_t len);
+    /**
+     * @brief Copies the bytes of src that differ from ref into dst, and reports the range of bytes that differed as
+     * [first, last). Returns whether any byte differed; first and last are left untouched if not. ref may be the same
+     * buffer as dst.
+     */
+    bool (*copy_compare)(uint8_t *dst, const uint8_t *ref, const uint8_t *src, size_t len,
+                         size_t *first, size_t *last);
+    /**
+     * @brief Converts n x8r8g8b8 pixels from src into r5g6b5 pixels in dst. The top byte of each source pixel is
+     * ignored, and the same kernel turns x8b8g8r8 into b5g6r5.
+     */
+    void (*convert_565)(uint8_t *dst, const uint8_t *src, size_t n);
+    /**
+     * @brief Swaps the first and third byte of n 32bpp pixels from src into dst, which converts between x8r8g8b8 and
+     * x8b8g8r8 in either direction.
+     */
+    void (*swap_rb)(uint8_t *dst, const uint8_t *src, size_t n);
+    /**
+     * @brief Returns a 64-bit hash of len bytes at p, mixed with seed. Every implementation returns the same hash, so
+     * rows can be chained into the hash of a rectangle by passing each row's hash as the seed of the next.
+     */
+    uint64_t (*hash)(uint64_t seed, const uint8_t *p, size_t len);
+} MuxKernels;
+
+/**
+ * @brief Kernels selected for the host CPU.
+ */
+extern MuxKernels mux_kernels;
+
+#endif //SHIM_KERNELS_H
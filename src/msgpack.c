@@ -1,5 +1,7 @@
 /** @file */
 #include "msgpack.h"
+#include "shm.h"
+#include "pacing.h"
 
 /**
  * @brief Initializes a new nnStr struct.
@@ -22,61 +24,6 @@ static void mux_nnstr_init(nnStr *msg, void *buf, int size)
     return;
 }
 
-/**
- * @brief Write some serialized data to the internal string buffer.
- *
- * This function is passed to the c-msgpack library to be used as its write() function. It transparently handles
- * re-allocing the internal buffer in case it runs of space, and updating the iterator to point to the end of the buffer
- * in memory.
- *
- * @returns Number of bytes written
- *
- * @param ctx The cmp struct that called the function
- * @param data The data to be written
- * @param count The size of data in bytes
- */
-static size_t mux_msg_writer(cmp_ctx_t *ctx, const void *data, size_t count)
-{
-    nnStr *msg = (nnStr *) ctx->buf;
-
-    if (msg->buf == NULL) {
-        // if buf needs to be newly allocated to hold our serialization
-        // This typically happens when we start creating our serialized data
-        // and this is the first invocation of mux_msg_writer.
-        mux_printf("Allocating new buffer");
-        void *new_buf = g_malloc0(count * sizeof(uint8_t));
-        if (new_buf) {
-            msg->buf = new_buf;
-            msg->size = malloc_usable_size(new_buf); // I have ruined portability forever.
-        } else {
-            mux_printf_error("Cannot allocate buffer");
-            return 0;
-        }
-    } else {
-        if ((msg->pos + count) > msg->size) {
-            // we need to realloc the size of our string
-            // g_realloc() will abort on error, but this is still good practice
-            // in case the implementation changes or we change to a different
-            // realloc later on.
-            void *new_buf = g_realloc(msg->buf, msg->size * 2); // more efficient
-            if (new_buf) {
-                msg->buf = new_buf;
-                msg->size = msg->size * 2;
-            } else {
-                // error reallocing, return null without changing the original string
-                mux_printf_error("Error reallocing buffer, returning 0");
-                return 0;
-            }
-        }
-    }
-    uint8_t *serialized = (uint8_t *) msg->buf;
-    uint8_t *begin = serialized + msg->pos;
-
-    memcpy(begin, data, count);
-    msg->pos += count;
-    return count;
-}
-
 /**
  * @brief Read some serialized data out of the internal buffer
  *
@@ -131,6 +78,7 @@ static void mux_process_incoming_kb_msg(cmp_ctx_t *cmp, nnStr *msg)
         return;
     }
 
+    mux_pacing_record_input();
     callbacks.mux_receive_kb(keycode, flags);
 }
 
@@ -162,29 +110,64 @@ static void mux_process_incoming_mouse_msg(cmp_ctx_t *cmp, nnStr *msg)
         return;
     }
 
+    mux_pacing_record_input();
     callbacks.mux_receive_mouse(mouse_x, mouse_y, flags);
 }
 
-static void mux_process_incoming_complete_msg(cmp_ctx_t *cmp, nnStr *msg)
+static void mux_process_incoming_complete_msg(cmp_ctx_t *cmp, nnStr *msg, uint32_t array_size)
 {
-    uint32_t new_framerate, success;
+    uint32_t new_framerate, success, seq = 0;
+    bool has_seq = false;
 
     if (!cmp_read_uint(cmp, &success)) {
         mux_printf_error("success variable didn't work");
-        return;
+        goto release;
     }
 
     if (success != 1) {
         mux_printf_error("Unsuccessful update_complete");
-        return;
+    } else if (!cmp_read_uint(cmp, &new_framerate)) {
+        mux_printf_error("couldn't read framerate");
+    } else {
+        __atomic_store_n(&display->framerate, new_framerate, __ATOMIC_RELAXED);
+
+        // servers speaking protocol version 5 or later ack a specific frame.
+        if (array_size > 3) {
+            has_seq = cmp_read_uint(cmp, &seq);
+            if (!has_seq) {
+                mux_printf_error("couldn't read frame sequence number");
+            }
+        }
     }
 
-    if (!cmp_read_uint(cmp, &new_framerate)) {
-        mux_printf_error("couldn't read framerate");
+release:
+    // whatever the outcome, the server is done reading from the slot.
+    pthread_mutex_lock(&display->shm_lock);
+    mux_shm_release_slot(seq, has_seq);
+    pthread_mutex_unlock(&display->shm_lock);
+}
+
+/**
+ * @brief Deserializes format request messages and switches the display over to the requested format on the next
+ * refresh.
+ *
+ * Format request messages are encoded as a single uint32_t holding a pixman format code. A format of 0 asks for the
+ * framebuffer's own format.
+ *
+ * @param cmp The cmp struct that holds the serialized msgpack buffer.
+ */
+static void mux_process_incoming_format_msg(cmp_ctx_t *cmp)
+{
+    uint32_t format;
+
+    if (!cmp_read_uint(cmp, &format)) {
+        mux_printf_error("format wasn't read properly");
         return;
     }
 
-    display->framerate = new_framerate;
+    __atomic_store_n(&display->requested_format, format, __ATOMIC_RELAXED);
+    __atomic_store_n(&display->format_changed, true, __ATOMIC_RELEASE);
+    mux_refresh_timer_wake();
 }
 
 /**
@@ -202,7 +185,7 @@ void mux_process_incoming_msg(void *buf, int nbytes)
 
     nnStr msg;
     mux_nnstr_init(&msg, buf, nbytes);
-    cmp_init(&cmp, &msg, mux_msg_reader, mux_msg_writer);
+    cmp_init(&cmp, &msg, mux_msg_reader, NULL);
 
 //    mux_printf("Now deserializing msgpack array!");
 
@@ -227,9 +210,12 @@ void mux_process_incoming_msg(void *buf, int nbytes)
             mux_process_incoming_kb_msg(&cmp, &msg);
             break;
         case DISPLAY_UPDATE_COMPLETE:
-            mux_printf("Signaling shm_cond for DISPLAY_UPDATE_COMPLETE wakeup");
-            mux_process_incoming_complete_msg(&cmp, &msg);
-            pthread_cond_signal(&display->shm_cond);
+            mux_printf("Releasing framebuffer slot for DISPLAY_UPDATE_COMPLETE");
+            mux_process_incoming_complete_msg(&cmp, &msg, array_size);
+            break;
+        case FORMAT_REQUEST:
+            mux_printf("Processing incoming format request");
+            mux_process_incoming_format_msg(&cmp);
             break;
         default:
             mux_printf_error("Invalid message type");
@@ -240,101 +226,304 @@ void mux_process_incoming_msg(void *buf, int nbytes)
     return;
 }
 
+/*
+ * Outgoing messages are short arrays of integers with a known upper bound on their size, so instead of going through
+ * cmp and a growing buffer, they're encoded straight into a buffer of MUX_MSG_MAX_SIZE bytes. The encoding is the same
+ * as cmp's: every integer takes the smallest msgpack representation that holds it.
+ */
+
 /**
- * @brief Serializes a display update event to a msgpack message.
+ * @brief Writes a msgpack type marker followed by a big-endian value.
  *
- * @param cmp The cmp struct that holds the write buffer.
- * @param update The update to serialize.
+ * @returns Pointer past the written bytes.
+ *
+ * @param p Where to write.
+ * @param marker The type marker.
+ * @param v The value.
+ * @param bytes Size of the value in bytes.
  */
-static void mux_write_outgoing_update_msg(cmp_ctx_t *cmp, MuxUpdate *update)
+static inline uint8_t *mux_pack_marked(uint8_t *p, uint8_t marker, uint64_t v, int bytes)
 {
-    display_update u = update->disp_update;
+    int i;
 
-    if (!cmp_write_array(cmp, 5))
-        mux_printf_error("Something went wrong writing array specifier");
+    *p++ = marker;
+    for (i = bytes - 1; i >= 0; i--) {
+        *p++ = (uint8_t) (v >> (8 * i));
+    }
+    return p;
+}
 
-    if (!cmp_write_uint(cmp, update->type))
-        mux_printf_error("Something went wrong writing update type");
+/**
+ * @brief Writes an array header.
+ *
+ * @returns Pointer past the written bytes.
+ *
+ * @param p Where to write.
+ * @param n Number of elements in the array.
+ */
+static inline uint8_t *mux_pack_array(uint8_t *p, uint32_t n)
+{
+    if (n <= 0xF) {
+        *p++ = 0x90 | n;
+        return p;
+    }
+    return n <= 0xFFFF ? mux_pack_marked(p, 0xDC, n, 2) : mux_pack_marked(p, 0xDD, n, 4);
+}
 
-    if (!cmp_write_uint(cmp, u.x1))
-        mux_printf_error("Something went wrong writing x");
+/**
+ * @brief Writes an unsigned integer.
+ *
+ * @returns Pointer past the written bytes.
+ *
+ * @param p Where to write.
+ * @param u The integer.
+ */
+static inline uint8_t *mux_pack_uint(uint8_t *p, uint64_t u)
+{
+    if (u <= 0x7F) {
+        *p++ = (uint8_t) u;
+        return p;
+    }
+    if (u <= 0xFF) {
+        return mux_pack_marked(p, 0xCC, u, 1);
+    }
+    if (u <= 0xFFFF) {
+        return mux_pack_marked(p, 0xCD, u, 2);
+    }
+    if (u <= 0xFFFFFFFF) {
+        return mux_pack_marked(p, 0xCE, u, 4);
+    }
+    return mux_pack_marked(p, 0xCF, u, 8);
+}
 
-    if (!cmp_write_uint(cmp, u.y1))
-        mux_printf_error("Something went wrong writing y");
+/**
+ * @brief Writes a signed integer.
+ *
+ * @returns Pointer past the written bytes.
+ *
+ * @param p Where to write.
+ * @param d The integer.
+ */
+static inline uint8_t *mux_pack_int(uint8_t *p, int64_t d)
+{
+    if (d >= 0) {
+        return mux_pack_uint(p, d);
+    }
+    if (d >= -32) {
+        *p++ = (uint8_t) d;
+        return p;
+    }
+    if (d >= -128) {
+        return mux_pack_marked(p, 0xD0, (uint64_t) d, 1);
+    }
+    if (d >= -32768) {
+        return mux_pack_marked(p, 0xD1, (uint64_t) d, 2);
+    }
+    if (d >= INT32_MIN) {
+        return mux_pack_marked(p, 0xD2, (uint64_t) d, 4);
+    }
+    return mux_pack_marked(p, 0xD3, (uint64_t) d, 8);
+}
 
-    if (!cmp_write_uint(cmp, (u.x2 - u.x1)))
-        mux_printf_error("Something went wrong writing w");
+/**
+ * @brief Writes a boolean.
+ *
+ * @returns Pointer past the written byte.
+ *
+ * @param p Where to write.
+ * @param b The boolean.
+ */
+static inline uint8_t *mux_pack_bool(uint8_t *p, bool b)
+{
+    *p++ = b ? 0xC3 : 0xC2;
+    return p;
+}
 
-    if (!cmp_write_uint(cmp, (u.y2 - u.y1)))
-        mux_printf_error("Something went wrong writing h");
+/**
+ * @brief Serializes a display update event to a msgpack message.
+ *
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
+ * @param update The update to serialize.
+ */
+static uint8_t *mux_write_outgoing_update_msg(uint8_t *p, MuxUpdate *update)
+{
+    display_update *u = &update->disp_update;
+    int i;
+
+    p = mux_pack_array(p, 4 + (4 * u->num_rects));
+    p = mux_pack_uint(p, update->type);
+    p = mux_pack_uint(p, u->slot);
+    p = mux_pack_uint(p, u->seq);
+    p = mux_pack_uint(p, u->num_rects);
+
+    for (i = 0; i < u->num_rects; i++) {
+        pixman_box32_t *r = &u->rects[i];
+
+        p = mux_pack_uint(p, r->x1);
+        p = mux_pack_uint(p, r->y1);
+        p = mux_pack_uint(p, (r->x2 - r->x1));
+        p = mux_pack_uint(p, (r->y2 - r->y1));
+    }
+    return p;
 }
 
 /**
  * @brief Serializes a display switch event to a msgpack message.
  *
- * @param cmp The cmp struct that holds the write buffer.
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
  * @param update The update to serialize.
  */
-static void mux_write_outgoing_switch_msg(cmp_ctx_t *cmp, MuxUpdate *update)
+static uint8_t *mux_write_outgoing_switch_msg(uint8_t *p, MuxUpdate *update)
 {
-    display_switch u = update->disp_switch;
-
-    if (!cmp_write_array(cmp, 4))
-        mux_printf_error("Something went wrong writing array specifier");
-
-    if (!cmp_write_uint(cmp, update->type))
-        mux_printf_error("Something went wrong writing update type");
-
-    if (!cmp_write_uint(cmp, u.format))
-        mux_printf_error("Something went wrong writing format");
+    display_switch *u = &update->disp_switch;
+
+    p = mux_pack_array(p, 9);
+    p = mux_pack_uint(p, update->type);
+    p = mux_pack_uint(p, u->format);
+    p = mux_pack_uint(p, u->w);
+    p = mux_pack_uint(p, u->h);
+    p = mux_pack_uint(p, u->shm_size);
+    p = mux_pack_uint(p, u->shm_generation);
+    p = mux_pack_uint(p, u->num_slots);
+    p = mux_pack_uint(p, u->slot_size);
+    p = mux_pack_uint(p, u->seq);
+    return p;
+}
 
-    if (!cmp_write_uint(cmp, u.w))
-        mux_printf_error("Something went wrong writing w");
+/**
+ * @brief Serializes a cursor shape change to a msgpack message.
+ *
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
+ * @param update The update to serialize.
+ */
+static uint8_t *mux_write_outgoing_cursor_define_msg(uint8_t *p, MuxUpdate *update)
+{
+    cursor_define *u = &update->cursor;
+
+    p = mux_pack_array(p, 6);
+    p = mux_pack_uint(p, update->type);
+    p = mux_pack_uint(p, u->serial);
+    p = mux_pack_uint(p, u->w);
+    p = mux_pack_uint(p, u->h);
+    p = mux_pack_uint(p, u->hot_x);
+    p = mux_pack_uint(p, u->hot_y);
+    return p;
+}
 
-    if (!cmp_write_uint(cmp, u.h))
-        mux_printf_error("Something went wrong writing h");
+/**
+ * @brief Serializes a cursor move to a msgpack message.
+ *
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
+ * @param update The update to serialize.
+ */
+static uint8_t *mux_write_outgoing_cursor_move_msg(uint8_t *p, MuxUpdate *update)
+{
+    cursor_move *u = &update->cursor_pos;
+
+    p = mux_pack_array(p, 4);
+    p = mux_pack_uint(p, update->type);
+    // the hotspot can be off the top or left edge of the framebuffer.
+    p = mux_pack_int(p, u->x);
+    p = mux_pack_int(p, u->y);
+    p = mux_pack_bool(p, u->visible);
+    return p;
 }
 
-static void mux_write_outgoing_shutdown_msg(cmp_ctx_t *cmp)
+/**
+ * @brief Serializes a copy within the framebuffer to a msgpack message.
+ *
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
+ * @param update The update to serialize.
+ */
+static uint8_t *mux_write_outgoing_copy_msg(uint8_t *p, MuxUpdate *update)
 {
-    if (!cmp_write_array(cmp, 1))
-        mux_printf_error("Something went wrong writing array specifier");
+    copy_rect *u = &update->copy;
+
+    p = mux_pack_array(p, 8);
+    p = mux_pack_uint(p, update->type);
+    p = mux_pack_uint(p, u->seq);
+    p = mux_pack_uint(p, u->src.x1);
+    p = mux_pack_uint(p, u->src.y1);
+    p = mux_pack_uint(p, (u->src.x2 - u->src.x1));
+    p = mux_pack_uint(p, (u->src.y2 - u->src.y1));
+    p = mux_pack_uint(p, u->dst_x);
+    p = mux_pack_uint(p, u->dst_y);
+    return p;
+}
 
-    if (!cmp_write_uint(cmp, SHUTDOWN))
-        mux_printf_error("Something went wrong writing update type");
+/**
+ * @brief Serializes a set of solid fills to a msgpack message.
+ *
+ * @returns Pointer past the written message.
+ *
+ * @param p Where to write the message.
+ * @param update The update to serialize.
+ */
+static uint8_t *mux_write_outgoing_fill_msg(uint8_t *p, MuxUpdate *update)
+{
+    fill_update *u = &update->fill;
+    int i;
+
+    p = mux_pack_array(p, 3 + (5 * u->num_rects));
+    p = mux_pack_uint(p, update->type);
+    p = mux_pack_uint(p, u->seq);
+    p = mux_pack_uint(p, u->num_rects);
+
+    for (i = 0; i < u->num_rects; i++) {
+        pixman_box32_t *r = &u->rects[i];
+
+        p = mux_pack_uint(p, r->x1);
+        p = mux_pack_uint(p, r->y1);
+        p = mux_pack_uint(p, (r->x2 - r->x1));
+        p = mux_pack_uint(p, (r->y2 - r->y1));
+        p = mux_pack_uint(p, u->colours[i]);
+    }
+    return p;
 }
 
 /**
  * @brief Writes an outgoing event to a msgpack-encoded message.
  *
- * @returns Size of successfully written data in bytes.
+ * @returns Size of the written message in bytes.
  *
- * @param update The update to serialize.
- * @param msg The blank nnStr message to write the message to.
+ * @param update The update to serialize, or NULL for a shutdown message.
+ * @param buf The buffer to write the message to. Must hold at least MUX_MSG_MAX_SIZE bytes.
  */
-size_t mux_write_outgoing_msg(MuxUpdate *update, nnStr *msg)
+size_t mux_write_outgoing_msg(MuxUpdate *update, uint8_t *buf)
 {
-    // takes a struct and serializes it to a msgpack message.
-    //printf("LIBSHIM: Writing a new message now!");
-    cmp_ctx_t cmp;
-    //nnStr msg;
-    mux_nnstr_init(msg, msg->buf, 0);
-    cmp_init(&cmp, msg, mux_msg_reader, mux_msg_writer);
+    uint8_t *p = buf;
 
     if (update == NULL) {
-        mux_write_outgoing_shutdown_msg(&cmp);
-        return msg->size;
+        p = mux_pack_array(p, 1);
+        p = mux_pack_uint(p, SHUTDOWN);
+        return p - buf;
     }
 
     if (update->type == DISPLAY_UPDATE) {
-        mux_write_outgoing_update_msg(&cmp, update);
+        p = mux_write_outgoing_update_msg(p, update);
     } else if (update->type == DISPLAY_SWITCH) {
-        mux_write_outgoing_switch_msg(&cmp, update);
+        p = mux_write_outgoing_switch_msg(p, update);
+    } else if (update->type == COPY_RECT) {
+        p = mux_write_outgoing_copy_msg(p, update);
+    } else if (update->type == FILL) {
+        p = mux_write_outgoing_fill_msg(p, update);
+    } else if (update->type == CURSOR_DEFINE) {
+        p = mux_write_outgoing_cursor_define_msg(p, update);
+    } else if (update->type == CURSOR_MOVE) {
+        p = mux_write_outgoing_cursor_move_msg(p, update);
     } else {
         mux_printf_error("Unknown message type queued for writing!");
     }
 
-    size_t len = msg->size;
-    return len;
+    return p - buf;
 }
-
@@ -5,18 +5,26 @@
 #ifndef SHIM_MSGPACK_H
 #define SHIM_MSGPACK_H
 
-#include <malloc.h>
-
 #include "common.h"
 #include "lib/c-msgpack.h"
 
+/**
+ * @brief Largest number of fields in an outgoing message.
+ */
+#define MUX_MSG_MAX_FIELDS MAX(4 + (4 * MUX_MAX_DAMAGE_RECTS), 3 + (5 * MUX_MAX_FILL_RECTS))
+
+/**
+ * @brief Largest size of an encoded outgoing message in bytes: the array header, and at most 9 bytes per field.
+ */
+#define MUX_MSG_MAX_SIZE (5 + (9 * MUX_MSG_MAX_FIELDS))
+
 typedef struct nn_str {
     void *buf; // pointer to char data
     size_t size; // size of data buffer in bytes
     int pos; // current read position in buffer
 } nnStr;
 
-size_t mux_write_outgoing_msg(MuxUpdate *update, nnStr *msg);
+size_t mux_write_outgoing_msg(MuxUpdate *update, uint8_t *buf);
 void mux_process_incoming_msg(void *buf, int nbytes);
 
 #endif //SHIM_MSGPACK_H
@@ -0,0 +1,113 @@
+/** @file */
+#include <time.h>
+
+#include "pacing.h"
+
+/*
+ * mux_display_refresh() tells the hypervisor when to call it next. The interval is picked here, from three
+ * exponentially weighted moving averages: how often refreshes find damage, how long the copy into shared memory
+ * takes, and how long the server takes to acknowledge a frame.
+ *
+ * While the guest is busy, the interval halves on every refresh that sends a frame, down to the server's target
+ * framerate. It never goes below twice the copy time, so copying can't take up more than half of the thread, nor
+ * below the time the server needs per slot, since frames sent faster than that would only pile up. When every slot
+ * is still in use, the server is lagging and the interval grows. Once the guest has been idle for a while, it doubles
+ * on every empty refresh, up to MUX_PACING_IDLE_INTERVAL. Input from the server usually means damage is about to
+ * follow, so it snaps the interval back to the fastest rate right away.
+ */
+
+/**
+ * @brief Returns a monotonic timestamp in ns.
+ */
+int64_t mux_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/**
+ * @brief Moves an average towards a new sample.
+ *
+ * @param avg The average.
+ * @param sample The new sample.
+ */
+static inline int64_t mux_pacing_ewma(int64_t avg, int64_t sample)
+{
+    return avg + ((sample - avg) / (1 << MUX_PACING_EWMA_SHIFT));
+}
+
+/**
+ * @brief Resets the pacing controller to the server's target framerate.
+ */
+void mux_pacing_init(void)
+{
+    MuxPacing *p = &display->pacing;
+
+    p->interval_ns = 1000000000LL / MAX(__atomic_load_n(&display->framerate, __ATOMIC_RELAXED), 1);
+    p->activity = 0;
+    p->copy_ns = 0;
+    p->rtt_ns = 0;
+    p->input = false;
+}
+
+/**
+ * @brief Records how long the server took to acknowledge a frame. Called from the mainloop thread.
+ *
+ * @param rtt_ns Time between the frame being queued and its acknowledgement, in ns.
+ */
+void mux_pacing_record_ack(int64_t rtt_ns)
+{
+    MuxPacing *p = &display->pacing;
+    int64_t avg = __atomic_load_n(&p->rtt_ns, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&p->rtt_ns, mux_pacing_ewma(avg, rtt_ns), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Records that input arrived from the server. Called from the mainloop thread.
+ */
+void mux_pacing_record_input(void)
+{
+    __atomic_store_n(&display->pacing.input, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Feeds the outcome of a refresh into the pacing controller, and picks the time until the next one.
+ *
+ * @returns The time until the next refresh, in ms.
+ *
+ * @param outcome What the refresh did.
+ * @param copy_ns Time spent copying damage into shared memory, in ns. Only used if the refresh wrote a slot.
+ */
+uint32_t mux_pacing_next_interval(MuxRefreshOutcome outcome, int64_t copy_ns)
+{
+    MuxPacing *p = &display->pacing;
+    int64_t rtt_ns = __atomic_load_n(&p->rtt_ns, __ATOMIC_RELAXED);
+    int64_t idle_ns = (int64_t) MUX_PACING_IDLE_INTERVAL * 1000000;
+    int64_t floor_ns = 1000000000LL / MAX(__atomic_load_n(&display->framerate, __ATOMIC_RELAXED), 1);
+    bool input = __atomic_exchange_n(&p->input, false, __ATOMIC_RELAXED);
+
+    p->activity = mux_pacing_ewma(p->activity, outcome == MUX_REFRESH_IDLE ? 0 : MUX_PACING_ONE);
+    if (outcome == MUX_REFRESH_DONE) {
+        p->copy_ns = mux_pacing_ewma(p->copy_ns, copy_ns);
+    }
+
+    floor_ns = MAX(floor_ns, 2 * p->copy_ns);
+    if (!display->ackless) {
+        floor_ns = MAX(floor_ns, rtt_ns / MAX(display->num_slots, 1));
+    }
+
+    if (input) {
+        p->interval_ns = floor_ns;
+    } else if (outcome == MUX_REFRESH_DONE) {
+        p->interval_ns /= 2;
+    } else if (outcome == MUX_REFRESH_DEFERRED) {
+        p->interval_ns = MAX(p->interval_ns + (p->interval_ns / 2), rtt_ns);
+    } else if (p->activity < MUX_PACING_IDLE_ACTIVITY) {
+        p->interval_ns *= 2;
+    }
+
+    p->interval_ns = MIN(MAX(p->interval_ns, floor_ns), MAX(idle_ns, floor_ns));
+    return (uint32_t) MAX((p->interval_ns + 999999) / 1000000, 1);
+}
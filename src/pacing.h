@@ -0,0 +1,50 @@
+#ifndef SHIM_PACING_H
+#define SHIM_PACING_H
+
+#include "common.h"
+
+/**
+ * @brief Fixed-point value of 1 for the activity average.
+ */
+#define MUX_PACING_ONE 1024
+
+/**
+ * @brief Every new sample moves an average 1/2^MUX_PACING_EWMA_SHIFT of the way towards itself.
+ */
+#define MUX_PACING_EWMA_SHIFT 3
+
+/**
+ * @brief Longest refresh interval in ms, used once the guest has been idle for a while.
+ */
+#define MUX_PACING_IDLE_INTERVAL 500
+
+/**
+ * @brief Below this activity, the guest counts as idle and the refresh interval backs off.
+ */
+#define MUX_PACING_IDLE_ACTIVITY (MUX_PACING_ONE / 16)
+
+/**
+ * @brief What a refresh ended up doing, as reported to the pacing controller.
+ */
+typedef enum MuxRefreshOutcome {
+    /**
+     * @brief There was no damage.
+     */
+    MUX_REFRESH_IDLE,
+    /**
+     * @brief There was damage, but every slot was still in use by the server.
+     */
+    MUX_REFRESH_DEFERRED,
+    /**
+     * @brief The damage was written to a slot.
+     */
+    MUX_REFRESH_DONE
+} MuxRefreshOutcome;
+
+int64_t mux_time_ns(void);
+void mux_pacing_init(void);
+void mux_pacing_record_ack(int64_t rtt_ns);
+void mux_pacing_record_input(void);
+uint32_t mux_pacing_next_interval(MuxRefreshOutcome outcome, int64_t copy_ns);
+
+#endif //SHIM_PACING_H
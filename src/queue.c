@@ -1,6 +1,52 @@
 /** @file */
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
 #include "queue.h"
 
+/*
+ * The ring follows Dmitry Vyukov's bounded queue: every cell carries the position it's ready for, so producers and
+ * consumers only contend on the head or tail counter they move, and never take a lock. The hypervisor thread, the out
+ * loop and the refresh timer all enqueue, while the mainloop dequeues, and display switches clear the queue from
+ * whichever thread they run on.
+ *
+ * The ring can't grow, and producers can't be made to wait for room, since some of them enqueue while holding locks
+ * the mainloop needs. Past the ring's high-water mark of MUX_QUEUE_SIZE updates, new updates go into a locked list
+ * instead, until the consumer has caught up.
+ */
+
+#define MUX_QUEUE_MASK (MUX_QUEUE_SIZE - 1)
+
+/**
+ * @brief Initializes a queue.
+ *
+ * @returns Whether the queue's eventfd could be created.
+ * @param q The queue to initialize.
+ */
+bool mux_queue_init(MuxMsgQueue *q)
+{
+    size_t i;
+
+    for (i = 0; i < MUX_QUEUE_SIZE; i++) {
+        q->cells[i].seq = i;
+        q->cells[i].update = NULL;
+    }
+    q->head = 0;
+    q->tail = 0;
+    q->spilled = false;
+    q->waiting = false;
+    SIMPLEQ_INIT(&q->updates);
+    pthread_mutex_init(&q->lock, NULL);
+
+    q->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q->event_fd < 0) {
+        mux_printf_error("Could not create queue eventfd: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 /**
  * @brief Checks if the queue is empty.
  *
@@ -9,11 +55,105 @@
  */
 bool mux_queue_check_is_empty(MuxMsgQueue *q)
 {
-    return SIMPLEQ_EMPTY(&q->updates);
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+    size_t seq = __atomic_load_n(&q->cells[pos & MUX_QUEUE_MASK].seq, __ATOMIC_SEQ_CST);
+
+    return seq != pos + 1 && !__atomic_load_n(&q->spilled, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Puts an update into the ring.
+ *
+ * @returns Whether there was room for it.
+ * @param q The queue.
+ * @param update The update.
+ */
+static bool mux_queue_ring_push(MuxMsgQueue *q, MuxUpdate *update)
+{
+    MuxQueueCell *cell;
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        cell = &q->cells[pos & MUX_QUEUE_MASK];
+        intptr_t dif = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // the cell still holds the update from the previous lap.
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->update = update;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+    return true;
 }
 
 /**
- * @brief Dequeues an update.
+ * @brief Takes an update out of the ring.
+ *
+ * @returns The update, or NULL if the ring is empty.
+ * @param q The queue.
+ */
+static MuxUpdate *mux_queue_ring_pop(MuxMsgQueue *q)
+{
+    MuxQueueCell *cell;
+    MuxUpdate *update;
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        cell = &q->cells[pos & MUX_QUEUE_MASK];
+        intptr_t dif = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    update = cell->update;
+    __atomic_store_n(&cell->seq, pos + MUX_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return update;
+}
+
+/**
+ * @brief Dequeues an update if there is one.
+ *
+ * @returns Pointer to the update, or NULL if the queue is empty.
+ * @param q The queue to dequeue from.
+ */
+void *mux_queue_try_dequeue(MuxMsgQueue *q)
+{
+    MuxUpdate *update = mux_queue_ring_pop(q);
+
+    // updates in the overflow list were queued after everything in the ring, so they're only taken once it's empty.
+    if (update != NULL || !__atomic_load_n(&q->spilled, __ATOMIC_ACQUIRE)) {
+        return update;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if ((update = SIMPLEQ_FIRST(&q->updates)) != NULL) {
+        SIMPLEQ_REMOVE_HEAD(&q->updates, next);
+    }
+    if (SIMPLEQ_EMPTY(&q->updates)) {
+        __atomic_store_n(&q->spilled, false, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return update;
+}
+
+/**
+ * @brief Dequeues an update, waiting for one if the queue is empty.
  *
  * @returns Pointer to the update.
  * @param q The queue to dequeue from.
@@ -21,33 +161,187 @@ bool mux_queue_check_is_empty(MuxMsgQueue *q)
 void *mux_queue_dequeue(MuxMsgQueue *q)
 {
     void *ret;
-    // take lock on the mutex
-    pthread_mutex_lock(&q->lock);
-    // while the queue is empty, wait
-    while (mux_queue_check_is_empty(q)) {
-        pthread_cond_wait(&q->cond, &q->lock);
-    }
-    // remove the head of the queue
-    ret = (void *) SIMPLEQ_FIRST(&q->updates);
-    SIMPLEQ_REMOVE_HEAD(&q->updates, next);
-    // unlock
-    pthread_mutex_unlock(&q->lock);
-    // return value
+    struct pollfd pfd = { .fd = q->event_fd, .events = POLLIN };
+
+    while ((ret = mux_queue_try_dequeue(q)) == NULL) {
+        if (mux_queue_prepare_wait(q)) {
+            poll(&pfd, 1, -1);
+            mux_queue_finish_wait(q);
+        }
+    }
     return ret;
 }
 
 /**
- * @brief Enqueues an update.
+ * @brief Enqueues an update. Doesn't take a lock unless the ring is full.
  *
  * @param q The queue to stick the update on.
  * @param update The update to stick on the queue.
  */
 void mux_queue_enqueue(MuxMsgQueue *q, MuxUpdate *update)
 {
-    pthread_mutex_lock(&q->lock);
-    SIMPLEQ_INSERT_TAIL(&q->updates, update, next);
-    pthread_cond_signal(&q->cond);
-    pthread_mutex_unlock(&q->lock);
+    if (__atomic_load_n(&q->spilled, __ATOMIC_ACQUIRE) || !mux_queue_ring_push(q, update)) {
+        pthread_mutex_lock(&q->lock);
+        // the consumer may have emptied the list in the meantime, in which case the ring has room again.
+        if (q->spilled || !mux_queue_ring_push(q, update)) {
+            if (!q->spilled) {
+                mux_printf_error("Outgoing queue passed its high-water mark of %d updates", MUX_QUEUE_SIZE);
+                __atomic_store_n(&q->spilled, true, __ATOMIC_SEQ_CST);
+            }
+            SIMPLEQ_INSERT_TAIL(&q->updates, update, next);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (__atomic_exchange_n(&q->waiting, false, __ATOMIC_SEQ_CST)) {
+        mux_queue_wake(q);
+    }
+}
+
+/**
+ * @brief Makes the queue's eventfd readable, to wake up the thread polling it even if nothing was queued.
+ *
+ * @param q The queue.
+ */
+void mux_queue_wake(MuxMsgQueue *q)
+{
+    uint64_t one = 1;
+
+    if (q->event_fd >= 0 && write(q->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        mux_printf_error("Could not signal queue eventfd: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Gets ready to sleep on the queue's eventfd. Producers signal the eventfd from now on.
+ *
+ * @returns Whether the consumer should go ahead and sleep, which it shouldn't if something was queued already.
+ * @param q The queue.
+ */
+bool mux_queue_prepare_wait(MuxMsgQueue *q)
+{
+    __atomic_store_n(&q->waiting, true, __ATOMIC_SEQ_CST);
+    if (!mux_queue_check_is_empty(q)) {
+        __atomic_store_n(&q->waiting, false, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Resets the queue's eventfd after the consumer woke up.
+ *
+ * @param q The queue.
+ */
+void mux_queue_finish_wait(MuxMsgQueue *q)
+{
+    uint64_t count;
+
+    __atomic_store_n(&q->waiting, false, __ATOMIC_SEQ_CST);
+    if (q->event_fd >= 0 && read(q->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        mux_printf_error("Could not read queue eventfd: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Initializes a free stack with every entry of its pool free.
+ *
+ * @param stack The stack.
+ * @param n Number of entries in the pool.
+ */
+void mux_free_stack_init(MuxFreeStack *stack, uint32_t n)
+{
+    uint32_t i;
+
+    stack->next = g_malloc(n * sizeof(uint32_t));
+    for (i = 0; i < n; i++) {
+        stack->next[i] = i;
+    }
+    stack->top = n;
+}
+
+/**
+ * @brief Takes a free entry off a stack.
+ *
+ * @returns Index of the entry, or -1 if none are free.
+ * @param stack The stack.
+ */
+int mux_free_stack_pop(MuxFreeStack *stack)
+{
+    uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    uint32_t index;
+
+    do {
+        if ((index = (uint32_t) top) == 0) {
+            return -1;
+        }
+        // next may be stale if another thread takes the entry first, but then the count in top has moved on too.
+        next = (((top >> 32) + 1) << 32) | __atomic_load_n(&stack->next[index - 1], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&stack->top, &top, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return (int) index - 1;
+}
+
+/**
+ * @brief Puts a free entry back on a stack.
+ *
+ * @param stack The stack.
+ * @param i Index of the entry.
+ */
+void mux_free_stack_push(MuxFreeStack *stack, int i)
+{
+    uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        __atomic_store_n(&stack->next[i], (uint32_t) top, __ATOMIC_RELAXED);
+        next = (((top >> 32) + 1) << 32) | (uint32_t) (i + 1);
+    } while (!__atomic_compare_exchange_n(&stack->top, &top, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Fills an update pool.
+ *
+ * @param pool The pool.
+ */
+void mux_update_pool_init(MuxUpdatePool *pool)
+{
+    pool->updates = g_malloc0(MUX_UPDATE_POOL_SIZE * sizeof(MuxUpdate));
+    mux_free_stack_init(&pool->free, MUX_UPDATE_POOL_SIZE);
+}
+
+/**
+ * @brief Takes an update from the display's pool, or from the heap if the pool is empty.
+ *
+ * @returns A zeroed update, to be handed back with mux_update_free().
+ */
+MuxUpdate *mux_update_new(void)
+{
+    MuxUpdatePool *pool = &display->update_pool;
+    int i = mux_free_stack_pop(&pool->free);
+
+    if (i < 0) {
+        return g_malloc0(sizeof(MuxUpdate));
+    }
+    memset(&pool->updates[i], 0, sizeof(MuxUpdate));
+    return &pool->updates[i];
+}
+
+/**
+ * @brief Hands an update back to the pool it came from, or to the heap.
+ *
+ * @param update The update.
+ */
+void mux_update_free(MuxUpdate *update)
+{
+    MuxUpdatePool *pool = &display->update_pool;
+
+    if (update < pool->updates || update >= pool->updates + MUX_UPDATE_POOL_SIZE) {
+        g_free(update);
+        return;
+    }
+    mux_free_stack_push(&pool->free, (int) (update - pool->updates));
 }
 
 /**
@@ -58,10 +352,8 @@ void mux_queue_enqueue(MuxMsgQueue *q, MuxUpdate *update)
 void mux_queue_clear(MuxMsgQueue *q)
 {
     MuxUpdate *update;
-    pthread_mutex_lock(&q->lock);
-    while ((update = SIMPLEQ_FIRST(&q->updates)) != NULL) {
-        SIMPLEQ_REMOVE(&q->updates, update, MuxUpdate, next);
-        g_free(update);
+
+    while ((update = mux_queue_try_dequeue(q)) != NULL) {
+        mux_update_free(update);
     }
-    pthread_mutex_unlock(&q->lock);
 }
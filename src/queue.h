@@ -8,9 +8,20 @@
 #include "common.h"
 #include "lib/libqueue.h"
 
+bool mux_queue_init(MuxMsgQueue *q);
 void *mux_queue_dequeue(MuxMsgQueue *q);
+void *mux_queue_try_dequeue(MuxMsgQueue *q);
 void mux_queue_enqueue(MuxMsgQueue *q, MuxUpdate *update);
+void mux_queue_wake(MuxMsgQueue *q);
+bool mux_queue_prepare_wait(MuxMsgQueue *q);
+void mux_queue_finish_wait(MuxMsgQueue *q);
 void mux_queue_clear(MuxMsgQueue *q);
+void mux_free_stack_init(MuxFreeStack *stack, uint32_t n);
+int mux_free_stack_pop(MuxFreeStack *stack);
+void mux_free_stack_push(MuxFreeStack *stack, int i);
+void mux_update_pool_init(MuxUpdatePool *pool);
+MuxUpdate *mux_update_new(void);
+void mux_update_free(MuxUpdate *update);
 bool mux_queue_check_is_empty(MuxMsgQueue *q);
 
 
@@ -1,94 +1,24 @@
 /** @file */
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <pixman.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 
 #include "common.h"
 #include "msgpack.h"
 #include "0mq.h"
 #include "queue.h"
+#include "framebuffer.h"
+#include "kernels.h"
+#include "workers.h"
+#include "shm.h"
+#include "scroll.h"
+#include "pacing.h"
 
 InputEventCallbacks callbacks;
 MuxDisplay *display;
 
-/**
- * @func Checks whether the bounding box of the display update needs to be expanded, and does so if necessary.
- *
- * This function is called when more than one display update event is received per refresh tick. It computes the smallest
- * bounding box of the display buffer that contains all the updated screen regions received thus far, and updates the
- * display update with the new coordinates.
- *
- * @param update The update object to update if necessary. Should be verified to be of type DISPLAY_UPDATE by caller.
- * @param x The X-coordinate of the top-left corner of the new region to be included in the update.
- * @param y The Y-coordinate of the top-left corner of the new region to be included in the update.
- * @param w The width of the new region to be included in the update.
- * @param h The height of the new region to be included in the update.
- */
-static void mux_expand_rect(MuxUpdate *update, int x, int y, int w, int h)
-{
-    display_update *u = &update->disp_update;
-
-    int new_x1 = x;
-    int new_y1 = y;
-    int new_x2 = x+w;
-    int new_y2 = y+h;
-
-    u->x1 = MIN(u->x1, new_x1);
-    u->y1 = MIN(u->y1, new_y1);
-    u->x2 = MAX(u->x2, new_x2);
-    u->y2 = MAX(u->y2, new_y2);
-}
-
-/**
- * @func Copies a pixel region from one buffer to another. The two buffers are assumed to have the same subpixel
- * layout and bpp. The function will transfer a given rectangle of certain dimension from the source buffer to
- * a rectangle in the destination buffer with the same width and height, but not necessarily the same coordinates.
- *
- * @param dstData Pointer to the destination buffer. Assumed to be big enough to hold the data being copied into it.
- * @param dstStep Scanline of dstData.
- * @param xDst x-coordinate of the top-left corner of the destination rectangle.
- * @param yDst y-coordinate of the top-left corner of the destination rectangle.
- * @param width width of the rectangle in px.
- * @param height height of the rectangle in px.
- * @param srcData Pointer to the source buffer.
- * @param srcStep Scanline of the source buffer.
- * @param xSrc x-coordinate of the top-left corner of the source rectangle.
- * @param ySrc y-coordinate of the top-left corner of the source rectangle.
- * @param bpp Bits per pixel of the two buffers.
- */
-static void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
-                            unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp)
-{
-	int lineSize;
-	int pixelSize;
-	unsigned char* pSrc;
-	unsigned char* pDst;
-	unsigned char* pEnd;
-
-	pixelSize = (bpp + 7) / 8;
-	lineSize = width * pixelSize;
-
-	pSrc = &srcData[(ySrc * srcStep) + (xSrc * pixelSize)];
-	pDst = &dstData[(yDst * dstStep) + (xDst * pixelSize)];
-
-
-    // when the source and destination rectangles are both strips
-    // of the framebuffer spanning the full width, it's much cheaper
-    // to do one memcpy rather than going line-by-line.
-	if ((srcStep == dstStep) && (lineSize == srcStep)) {
-		memcpy(pDst, pSrc, lineSize * height);
-	} else {
-		pEnd = pSrc + (srcStep * height);
-
-		while (pSrc < pEnd) {
-			memcpy(pDst, pSrc, lineSize);
-			pSrc += srcStep;
-			pDst += dstStep;
-		}
-	}
-}
-
 /**
  * @func Public API function designed to be called when a region of the framebuffer changes. For example, when a window
  * moves or an animation updates on screen.
@@ -104,40 +34,46 @@ static void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int y
 __PUBLIC void mux_display_update(int x, int y, int w, int h)
 {
     mux_printf("DCL display update event triggered");
-    MuxUpdate *update;
-    if (!display->dirty_update) {
-        update = g_malloc0(sizeof(MuxUpdate));
-        update->type = DISPLAY_UPDATE;
-        update->disp_update.x1 = x;
-        update->disp_update.y1 = y;
-        update->disp_update.x2 = x+w;
-        update->disp_update.y2 = y+h;
-        display->dirty_update = update;
-    } else {
-        // update dirty bounding box
-        update = display->dirty_update;
-        if (update->type != DISPLAY_UPDATE) {
-            return;
-        }
-        mux_expand_rect(update, x, y, w, h);
+    if (w <= 0 || h <= 0) {
+        return;
     }
 
-    mux_printf("Bounding box updated to [(%d, %d), (%d, %d)]", update->disp_update.x1, update->disp_update.x2,
-           update->disp_update.x2, update->disp_update.y2);
+    pthread_mutex_lock(&display->damage_lock);
+    pixman_region32_union_rect(&display->dirty_region, &display->dirty_region, x, y, w, h);
+    mux_printf("Dirty region now holds %d rects", pixman_region32_n_rects(&display->dirty_region));
+    pthread_mutex_unlock(&display->damage_lock);
+
+    mux_refresh_timer_wake();
 }
 
 /**
- * @func Public API function, to be called if the framebuffer surface changes in a user-facing way; for example, when the
- * display buffer resolution changes. In here, we create a new shared memory region for the framebuffer if necessary,
- * and do a straight memcpy of the new framebuffer data into the space. We then enqueue a display switch event that
- * contains the new shm region's information and the new dimensions of the display buffer. Finally, we notify the outside
- * about the new target framerate we'd like
+ * @func Queues a message telling the server about the current cursor shape.
+ */
+static void mux_queue_cursor_define(void)
+{
+    MuxUpdate *update = mux_update_new();
+    update->type = CURSOR_DEFINE;
+    update->cursor = display->cursor;
+    mux_queue_enqueue(&display->outgoing_messages, update);
+}
+
+/**
+ * @func Queues a message telling the server about the current cursor position.
+ */
+static void mux_queue_cursor_move(void)
+{
+    MuxUpdate *update = mux_update_new();
+    update->type = CURSOR_MOVE;
+    update->cursor_pos = display->cursor_pos;
+    mux_queue_enqueue(&display->outgoing_messages, update);
+}
+
+/**
+ * @func Switches the display over to a new surface. Must be called with refresh_lock held.
  *
  * @param surface The new framebuffer display surface.
- *
- * @returns Target framerate for the VM guest.
  */
-__PUBLIC void mux_display_switch(pixman_image_t *surface)
+static void mux_display_switch_locked(pixman_image_t *surface)
 {
     mux_printf("DCL display switch event triggered.");
 
@@ -147,155 +83,398 @@ __PUBLIC void mux_display_switch(pixman_image_t *surface)
     int width = pixman_image_get_width(display->surface);
     int height = pixman_image_get_height(display->surface);
 
-    // do all sorts of stuff to get the shmem region opened and ready
-    const char *socket_fmt = "/%d.rdpmux";
-    char socket_str[20] = ""; // 20 is a magic number carefully chosen
-                              // to be the length of INT_MAX plus the characters
-                              // in socket_fmt. If you change socket_fmt, make
-                              // sure to change this too.
-    int shm_size = 4096 * 2048 * sizeof(uint32_t); // rdp protocol has max framebuffer size 4096x2048
-    sprintf(socket_str, socket_fmt, display->vm_id);
-
-    // set up the shm region. This path only runs the first time a display switch event is received.
-    if (display->shmem_fd < 0) {
-        // this is the shm buffer being created! Hooray!
-        int shim_fd = shm_open(socket_str,
-                               O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
-        if (shim_fd < 0) {
-            mux_printf_error("shm_open failed: %s", strerror(errno));
-            return;
-        }
+    pixman_format_code_t format = pixman_image_get_format(display->surface);
+    pixman_format_code_t requested = __atomic_load_n(&display->requested_format, __ATOMIC_ACQUIRE);
+    int srcStride = pixman_image_get_stride(display->surface);
+    int stride;
+    uint32_t seq;
 
-        // resize the newly created shm region to the size of the framebuffer
-        if (ftruncate(shim_fd, shm_size)) {
-            mux_printf_error("ftruncate of new buffer failed: %s", strerror(errno));
-            return;
-        }
-        // save our new shm file descriptor for later use
-        display->shmem_fd = shim_fd;
-
-        // mmap the shm region into our process space
-        void *shm_buffer = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
-                                MAP_SHARED, display->shmem_fd, 0);
-        if (shm_buffer == MAP_FAILED) {
-            mux_printf_error("mmap failed: %s", strerror(errno));
-            return;
+    if (!mux_framebuffer_format_supported(format)) {
+        mux_printf_error("Unsupported framebuffer format %#x", format);
+        display->surface = NULL;
+        return;
+    }
+
+    if (!mux_shm_open()) {
+        display->surface = NULL;
+        return;
+    }
+
+    // a surface from mux_create_shared_surface() already lives in the shared memory region. anything else is
+    // copied in without the padding at the end of its rows.
+    display->zero_copy = ((unsigned char *) framebuf_data == mux_shm_slot_data(0));
+    display->num_rect_hashes = 0;
+    display->next_rect_hash = 0;
+
+    // the hypervisor renders straight into a zero-copy surface, so there's no copy to convert in.
+    display->conversion = NULL;
+    if (requested != 0 && requested != format && !display->zero_copy) {
+        display->conversion = mux_framebuffer_find_conversion(format, requested);
+        if (display->conversion == NULL) {
+            mux_printf_error("Cannot convert framebuffer format %#x to %#x, sending it as-is", format, requested);
+        } else {
+            format = requested;
         }
+    }
+
+    stride = display->zero_copy ? srcStride : width * (PIXMAN_FORMAT_BPP(format) / 8);
+
+    // any damage collected so far is covered by the new frame.
+    pthread_mutex_lock(&display->damage_lock);
+    pixman_region32_clear(&display->dirty_region);
+    pthread_mutex_unlock(&display->damage_lock);
 
-        // save the pointer to the buffer for later use
-        display->shm_buffer = shm_buffer;
+    pthread_mutex_lock(&display->shm_lock);
+
+    // clear the outgoing queues (all those old messages for the old display
+    // are now totally invalid since we have a new display to work against).
+    // this happens under shm_lock so that the out loop can't queue an update
+    // for the old display in between.
+    mux_queue_clear(&display->outgoing_messages);
+
+    if (!mux_shm_reset_slots(width, height, stride, format, &seq)) {
+        pthread_mutex_unlock(&display->shm_lock);
+        display->surface = NULL;
+        return;
+    }
+    if (!display->zero_copy) {
+        mux_framebuffer_copy_rows(mux_shm_slot_data(0), stride, (unsigned char *) framebuf_data, srcStride,
+                                  width, PIXMAN_FORMAT_BPP(format), display->conversion, 0, height);
     }
+    mux_shm_finish_reset();
 
     // create the event update
-    MuxUpdate *update = g_malloc0(sizeof(MuxUpdate));
+    MuxUpdate *update = mux_update_new();
     update->type = DISPLAY_SWITCH;
     update->disp_switch.shm_fd = display->shmem_fd;
     update->disp_switch.w = width;
     update->disp_switch.h = height;
-    update->disp_switch.format = pixman_image_get_format(display->surface);
+    update->disp_switch.format = format;
+    update->disp_switch.shm_size = display->shm_size;
+    update->disp_switch.shm_generation = display->shm_generation;
+    update->disp_switch.num_slots = display->num_slots;
+    update->disp_switch.slot_size = display->slot_size;
+    update->disp_switch.seq = seq;
 
-    // clear the outgoing queues (all those old messages for the old display
-    // are now totally invalid since we have a new display to work against)
-    mux_queue_clear(&display->outgoing_messages);
+    // place our display switch update in the outgoing queue
+    mux_queue_enqueue(&display->outgoing_messages, update);
+
+    // clearing the queue may have dropped cursor messages, and the region may be a new one, so resend the cursor.
+    if (display->cursor.serial != 0) {
+        mux_queue_cursor_define();
+        mux_queue_cursor_move();
+    }
+    pthread_mutex_unlock(&display->shm_lock);
 
+    mux_printf("DISPLAY: DCL display switch callback completed successfully.");
+}
+
+/**
+ * @func Public API function, to be called if the framebuffer surface changes in a user-facing way; for example, when the
+ * display buffer resolution changes. In here, we create the shared memory region for the framebuffer if necessary, grow
+ * it if the new framebuffer doesn't fit, and do a straight memcpy of the new framebuffer data into the space, converting
+ * it to the format the server asked for if there is one and the library knows how. We then enqueue a display switch event that
+ * contains the new shm region's information and the new dimensions of the display buffer. Finally, we notify the outside
+ * about the new target framerate we'd like
+ *
+ * If the library runs its own refresh timer, this waits for a refresh in progress to finish, so the old surface can be
+ * freed once this returns.
+ *
+ * @param surface The new framebuffer display surface.
+ *
+ * @returns Target framerate for the VM guest.
+ */
+__PUBLIC void mux_display_switch(pixman_image_t *surface)
+{
+    pthread_mutex_lock(&display->refresh_lock);
+    mux_display_switch_locked(surface);
+    pthread_mutex_unlock(&display->refresh_lock);
+}
+
+/**
+ * @func Public API function that creates a framebuffer surface backed directly by the shared memory region, so that
+ * the hypervisor renders into memory the server reads from. Passing the surface to mux_display_switch() turns off all
+ * framebuffer copies: refreshes only tell the server what changed.
+ *
+ * There is only one such surface at a time. Creating a new one hands its memory over to the new surface, and may move
+ * the shared memory region to make room for it, so the old surface must not be used anymore; not even as the source
+ * of a display switch, or as a target for rendering. If the old surface is the current display surface, refreshes
+ * stop until the next display switch. The surface should be released with pixman_image_unref().
+ *
+ * Since the hypervisor writes to the surface whenever it likes, the server can see a frame that is still being
+ * rendered. The sequence locks in the shared memory header don't guard against this.
+ *
+ * @param width Width of the surface, in px.
+ * @param height Height of the surface, in px.
+ * @param format Pixel format of the surface.
+ *
+ * @returns The new surface, or NULL if it couldn't be created.
+ */
+__PUBLIC pixman_image_t *mux_create_shared_surface(int width, int height, pixman_format_code_t format)
+{
+    pixman_image_t *surface;
+    size_t stride;
+
+    if (width <= 0 || height <= 0) {
+        mux_printf_error("Invalid shared surface size %dx%d", width, height);
+        return NULL;
+    }
+
+    // pixman takes the stride as an int, so the rows can't be any longer than that.
+    stride = (((size_t) width * PIXMAN_FORMAT_BPP(format) + 31) / 32) * sizeof(uint32_t);
+    if (stride > INT_MAX || stride > SIZE_MAX / height) {
+        mux_printf_error("Shared surface of %dx%d is too large", width, height);
+        return NULL;
+    }
+
+    if (!mux_framebuffer_format_supported(format)) {
+        mux_printf_error("Unsupported shared surface format %#x", format);
+        return NULL;
+    }
+
+    if (!mux_shm_open()) {
+        return NULL;
+    }
+
+    // the region may move, so a refresh mustn't be copying into it. an earlier shared surface points into the old
+    // mapping and is invalid from here on, so refreshes stop reading it until the next display switch.
+    pthread_mutex_lock(&display->refresh_lock);
+    if (display->zero_copy) {
+        display->surface = NULL;
+        display->zero_copy = false;
+    }
     pthread_mutex_lock(&display->shm_lock);
-    memcpy(display->shm_buffer, framebuf_data,
-           width * height * sizeof(uint32_t));
+    if (!mux_shm_reserve_frame(stride * height)) {
+        pthread_mutex_unlock(&display->shm_lock);
+        pthread_mutex_unlock(&display->refresh_lock);
+        mux_printf_error("Shared surface of %dx%d does not fit in the shared memory region", width, height);
+        return NULL;
+    }
+    pthread_mutex_unlock(&display->shm_lock);
+    pthread_mutex_unlock(&display->refresh_lock);
 
-    // signal the shm condition to wake up the processing loop
-    pthread_cond_signal(&display->shm_cond);
+    surface = pixman_image_create_bits(format, width, height, (uint32_t *) mux_shm_slot_data(0), (int) stride);
+    if (surface == NULL) {
+        mux_printf_error("Could not create shared surface with format %#x", format);
+    }
+    return surface;
+}
+
+/**
+ * @func Public API function, to be called when the guest defines a new hardware cursor image. The image goes into the
+ * cursor area of the shared memory region, and the server is told to pick it up, so that the cursor can be drawn by
+ * the client instead of being part of the framebuffer.
+ *
+ * @param width Width of the cursor image in px. At most MUX_MAX_CURSOR_SIZE.
+ * @param height Height of the cursor image in px. At most MUX_MAX_CURSOR_SIZE.
+ * @param hot_x X-coordinate of the hotspot within the image.
+ * @param hot_y Y-coordinate of the hotspot within the image.
+ * @param pixels The cursor image, as a8r8g8b8 with rows packed to its width.
+ */
+__PUBLIC void mux_cursor_define(int width, int height, int hot_x, int hot_y, const uint32_t *pixels)
+{
+    if (width <= 0 || height <= 0 || width > MUX_MAX_CURSOR_SIZE || height > MUX_MAX_CURSOR_SIZE) {
+        mux_printf_error("Invalid cursor size %dx%d", width, height);
+        return;
+    }
+
+    if (!mux_shm_open()) {
+        return;
+    }
+
+    pthread_mutex_lock(&display->shm_lock);
+    display->cursor.serial++;
+    // 0 means no cursor has been defined yet.
+    if (display->cursor.serial == 0) {
+        display->cursor.serial++;
+    }
+    display->cursor.w = width;
+    display->cursor.h = height;
+    display->cursor.hot_x = hot_x;
+    display->cursor.hot_y = hot_y;
+    mux_shm_define_cursor(&display->cursor, pixels);
+    mux_queue_cursor_define();
     pthread_mutex_unlock(&display->shm_lock);
+}
 
+/**
+ * @func Public API function, to be called when the hardware cursor moves, or is shown or hidden. This costs a small
+ * message instead of damage to the framebuffer.
+ *
+ * @param x X-coordinate of the cursor's hotspot on the framebuffer in px.
+ * @param y Y-coordinate of the cursor's hotspot on the framebuffer in px.
+ * @param visible Whether the cursor should be drawn.
+ */
+__PUBLIC void mux_cursor_move(int x, int y, bool visible)
+{
+    if (!mux_shm_open()) {
+        return;
+    }
 
-    // place our display switch update in the outgoing queue
-    mux_queue_enqueue(&display->outgoing_messages, update);
-    mux_printf("DISPLAY: DCL display switch callback completed successfully.");
+    pthread_mutex_lock(&display->shm_lock);
+    display->cursor_pos.x = x;
+    display->cursor_pos.y = y;
+    display->cursor_pos.visible = visible;
+    mux_shm_move_cursor(&display->cursor_pos);
+    mux_queue_cursor_move();
+    pthread_mutex_unlock(&display->shm_lock);
 }
 
 /**
- * @func Public API function, to be called when the framebuffer display refreshes.
+ * @func Syncs damage into a framebuffer slot. Must be called with refresh_lock held.
  *
- * This function attempts to lock the shared memory region, and if it succeeds, will sync the framebuffer
- * to the shared memory and copy the current dirty update for transmission.
+ * @returns Time until the next refresh should happen, in ms.
+ *
+ * @param damage The damage to sync. If every slot is in use, it is handed back to the dirty region.
  */
-__PUBLIC uint32_t mux_display_refresh()
+static uint32_t mux_display_refresh_damage(pixman_region32_t *damage)
 {
-    if (display->dirty_update) {
-        if (pthread_mutex_trylock(&display->shm_lock) == 0) {
-            int pixelSize;
-            size_t x = 0;
-            size_t y = 0;
-            size_t w = 0;
-            size_t h = 0;
-            display_update* u;
-            size_t surfaceWidth = pixman_image_get_width(display->surface);
-            size_t surfaceHeight = pixman_image_get_height(display->surface);
-            int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(display->surface));
-            unsigned char* srcData = (unsigned char*) pixman_image_get_data(display->surface);
-            unsigned char* dstData = (unsigned char*) display->shm_buffer;
-
-            mux_printf("Now copying framebuffer to shmem region");
-
-            u = &display->dirty_update->disp_update;
-
-            // align the bounding box to 16 for memory alignment purposes
-            if (u->x1 % 16) {
-                u->x1 -= (u->x1 % 16);
-            }
+    int slot, ref;
+    int64_t start_ns;
+    int surfaceWidth, surfaceHeight, bpp, srcStep, dstStep;
+    unsigned char *srcData;
+    pixman_region32_t changed;
+    copy_rect copy;
+    fill_update fill;
+    bool has_copy = false;
+    bool same;
+
+    if (!pixman_region32_not_empty(damage)) {
+//        mux_printf("Refresh deferred");
+        return mux_pacing_next_interval(MUX_REFRESH_IDLE, 0);
+    }
 
-            if (u->y1 % 16) {
-                u->y1 -= (u->y1 % 16);
-            }
+    // the last display switch failed, so there's nowhere to put the damage.
+    if (display->surface == NULL) {
+        pixman_region32_clear(damage);
+        return mux_pacing_next_interval(MUX_REFRESH_IDLE, 0);
+    }
 
-            if (u->x2 % 16) {
-                u->x2 += 16 - (u->x2 % 16);
-            }
+    pthread_mutex_lock(&display->shm_lock);
+    slot = mux_shm_acquire_slot(&ref);
+    pthread_mutex_unlock(&display->shm_lock);
 
-            if (u->y2 % 16) {
-                u->y2 += 16 - (u->y2 % 16);
-            }
+    if (slot < 0) {
+        mux_printf("All framebuffer slots are in use, deferring refresh");
+        pthread_mutex_lock(&display->damage_lock);
+        pixman_region32_union(&display->dirty_region, &display->dirty_region, damage);
+        pthread_mutex_unlock(&display->damage_lock);
+        return mux_pacing_next_interval(MUX_REFRESH_DEFERRED, 0);
+    }
+    start_ns = mux_time_ns();
 
-            if (u->x2 > surfaceWidth) {
-                u->x2 = surfaceWidth;
-            }
+    surfaceWidth = pixman_image_get_width(display->surface);
+    surfaceHeight = pixman_image_get_height(display->surface);
+    bpp = PIXMAN_FORMAT_BPP(display->conversion ? display->conversion->to
+                                                : pixman_image_get_format(display->surface));
+    srcStep = pixman_image_get_stride(display->surface);
+    dstStep = display->slot_stride;
+    srcData = (unsigned char *) pixman_image_get_data(display->surface);
 
-            if (u->y2 > surfaceHeight) {
-                u->y2 = surfaceHeight;
-            }
+    // damage reported outside of the surface can't be copied.
+    pixman_region32_intersect_rect(damage, damage,
+                                   0, 0, surfaceWidth, surfaceHeight);
 
-            y = u->y1;
-            h = u->y2 - u->y1;
+    if (display->zero_copy) {
+        mux_framebuffer_drop_duplicates(srcData, srcStep, bpp, damage);
+        same = !pixman_region32_not_empty(damage);
 
-            pixelSize = (bpp + 7) / 8;
+        // publishing nothing hands the slot back without sending anything.
+        pthread_mutex_lock(&display->shm_lock);
+        mux_shm_publish_slot(slot, damage, NULL, NULL);
+        pthread_mutex_unlock(&display->shm_lock);
+        pixman_region32_clear(damage);
+        return mux_pacing_next_interval(same ? MUX_REFRESH_IDLE : MUX_REFRESH_DONE, mux_time_ns() - start_ns);
+    }
 
-            // aligning the copy offsets does not yield a good performance gain,
-            // but copying contiguous memory blocks makes a huge difference.
-            // by forcing copying of full lines on buffers with the same step,
-            // we can use a single memcpy rather than one memcpy per line.
-            // this may over-copy a bit sometimes, but it's still way cheaper.
-            x = 0;
-            w = surfaceWidth;
+    mux_printf("Now copying framebuffer to slot %d", slot);
 
-            mux_copy_pixels(dstData, w * pixelSize, x, y, w, h, srcData, w * pixelSize, x, y, bpp);
+    // catch the slot up on frames that were written to other slots since it was last used. this copies from the latest
+    // frame rather than the surface, which may hold pixels whose damage hasn't been reported yet; those would end up
+    // in the slot without being announced, and their damage would later be dropped as unchanged.
+    // the slot is ours until it's published, so this happens without holding the lock.
+    if (pixman_region32_not_empty(&display->slots[slot].stale)) {
+        mux_framebuffer_copy_region(mux_shm_slot_data(slot), dstStep, mux_shm_slot_data(ref), dstStep, surfaceWidth,
+                                    bpp, NULL, &display->slots[slot].stale);
+    }
 
-            if (display->out_update == NULL) {
-                mux_printf("Copying dirty update to out update");
-                display->out_update = g_memdup(display->dirty_update, sizeof(MuxUpdate));
-            } else {
-                mux_printf("Calculating new out update bounds");
-                mux_expand_rect(display->out_update, u->x1, u->y1, u->x2 - u->x1, u->y2 - u->y1);
-            }
+    // a copy can only be sent relative to the latest frame, not on top of a pending update. the slot and the latest
+    // frame are in the server's format, which the surface isn't if it's being converted.
+    if (display->conversion == NULL && !mux_shm_slot_pending(slot) &&
+        mux_scroll_detect(mux_shm_slot_data(ref), dstStep, srcData, srcStep, bpp,
+                          pixman_region32_extents(damage), &copy)) {
+        mux_printf("Scroll detected, copying %dx%d px", copy.src.x2 - copy.src.x1, copy.src.y2 - copy.src.y1);
+        mux_scroll_apply(mux_shm_slot_data(slot), mux_shm_slot_data(ref), dstStep, bpp, &copy);
+
+        // the copy was checked pixel by pixel, so there's nothing left to sync where it landed.
+        pixman_region32_init_rect(&changed, copy.dst_x, copy.dst_y,
+                                  copy.src.x2 - copy.src.x1, copy.src.y2 - copy.src.y1);
+        pixman_region32_subtract(damage, damage, &changed);
+        pixman_region32_fini(&changed);
+        has_copy = true;
+    }
 
-            g_free(display->dirty_update);
-            display->dirty_update = NULL;
+    pixman_region32_init(&changed);
+    mux_framebuffer_sync_region(mux_shm_slot_data(slot), mux_shm_slot_data(ref), dstStep,
+                                srcData, srcStep, surfaceWidth, bpp, display->conversion,
+                                damage, &changed);
+    pixman_region32_clear(damage);
 
-            pthread_cond_signal(&display->update_cond);
-            pthread_mutex_unlock(&display->shm_lock);
-        }
-    } else {
-//        mux_printf("Refresh deferred");
+    mux_framebuffer_find_fills(mux_shm_slot_data(slot), dstStep, bpp, &changed, &fill);
+
+    // damage that didn't change any pixels sends nothing, which the pacing controller counts as an idle refresh.
+    same = !has_copy && fill.num_rects == 0 && !pixman_region32_not_empty(&changed);
+
+    pthread_mutex_lock(&display->shm_lock);
+    mux_shm_publish_slot(slot, &changed, has_copy ? &copy : NULL, &fill);
+    pthread_mutex_unlock(&display->shm_lock);
+    pixman_region32_fini(&changed);
+
+    return mux_pacing_next_interval(same ? MUX_REFRESH_IDLE : MUX_REFRESH_DONE, mux_time_ns() - start_ns);
+}
+
+/**
+ * @func Public API function, to be called when the framebuffer display refreshes.
+ *
+ * This function picks a framebuffer slot that the server isn't reading from, brings it up to date, and syncs the dirty
+ * region into it. The parts of the dirty region that actually changed are handed to the out loop for transmission. If
+ * none of the damaged pixels changed, nothing is sent. If the server is still reading from every slot, the refresh is
+ * skipped and the damage carries over to the next one.
+ *
+ * Large damage is first checked for scrolls against the most recent frame. If part of it is just the previous frame
+ * shifted, that part is moved within the slot and sent as a copy, and only the rest is synced. Large parts of what
+ * changed that turn out to be a single colour are sent as fills rather than pixels.
+ *
+ * If the surface was created with mux_create_shared_surface(), there's nothing to copy, and the dirty region is
+ * handed to the out loop as-is, minus the rectangles whose contents hash the same as when they were last sent.
+ *
+ * If the server asked for a different pixel format since the last refresh, the display is switched over to it first.
+ *
+ * The hypervisor can keep reporting damage while a refresh is in progress; it is picked up by the next one.
+ *
+ * @returns Time until the next refresh should happen, in ms. It is picked by the pacing controller in pacing.c, and
+ * is never shorter than the server's target framerate allows.
+ */
+__PUBLIC uint32_t mux_display_refresh()
+{
+    uint32_t interval;
+    pixman_region32_t damage;
+
+    pthread_mutex_lock(&display->refresh_lock);
+    if (__atomic_exchange_n(&display->format_changed, false, __ATOMIC_ACQ_REL) && display->surface != NULL) {
+        mux_display_switch_locked(display->surface);
     }
-    return (uint32_t) (1000 / display->framerate);
+
+    // the region is moved out rather than copied, which leaves an empty one behind.
+    pthread_mutex_lock(&display->damage_lock);
+    damage = display->dirty_region;
+    pixman_region32_init(&display->dirty_region);
+    pthread_mutex_unlock(&display->damage_lock);
+
+    interval = mux_display_refresh_damage(&damage);
+    pixman_region32_fini(&damage);
+    pthread_mutex_unlock(&display->refresh_lock);
+    return interval;
 }
 
 /*
@@ -306,25 +485,24 @@ __PUBLIC uint32_t mux_display_refresh()
  * @func Outgoing message loop. It is designed to be run as a thread runloop, and should be dispatched as a runnable
  * inside a separate thread during library initialization. Its function prototype matches what pthreads et al. expect.
  *
- * This function queues outgoing messages, and blocks waiting for the server to copy data out of the shared memory
- * region and return an ack message to the library. This ensures that the library and server are not accessing the shared
- * memory concurrently.
+ * This function waits for frames to become ready in the shared memory framebuffer slots and queues display updates for
+ * them. It does not wait for the server to acknowledge a frame before queueing the next one; the slot bookkeeping
+ * makes sure the library never writes to a slot the server is still reading from.
  */
 __PUBLIC void mux_out_loop()
 {
-    while(true) {
-
-        // check if exiting
-        pthread_mutex_lock(&display->stop_lock);
-        if (display->stop) break;
-        pthread_mutex_unlock(&display->stop_lock);
+    MuxUpdate *update;
+    MuxUpdate *copy;
+    MuxUpdate *fill;
 
-        pthread_mutex_lock(&display->shm_lock);
-        while (display->out_update == NULL) {
+    pthread_mutex_lock(&display->shm_lock);
+    while (true) {
+        while ((update = mux_shm_take_ready_update(&copy, &fill)) == NULL) {
 
             // check if exiting
             pthread_mutex_lock(&display->stop_lock);
             if (display->stop) {
+                pthread_mutex_unlock(&display->stop_lock);
                 goto cleanup;
             }
             pthread_mutex_unlock(&display->stop_lock);
@@ -332,27 +510,15 @@ __PUBLIC void mux_out_loop()
             pthread_cond_wait(&display->update_cond, &display->shm_lock);
         }
 
-        // check if exiting
-        pthread_mutex_lock(&display->stop_lock);
-        if (display->stop) break;
-        pthread_mutex_unlock(&display->stop_lock);
-
-        // place the update on the outgoing queue
-        mux_queue_enqueue(&display->outgoing_messages, display->out_update);
-        display->out_update = NULL;
-        mux_printf("out_update qeueued and reset!");
-
-        // block on the signal.
-        mux_printf("Now waiting on ack from other process");
-        pthread_cond_wait(&display->shm_cond, &display->shm_lock);
-
-        // check if exiting
-        pthread_mutex_lock(&display->stop_lock);
-        if (display->stop) break;
-        pthread_mutex_unlock(&display->stop_lock);
-
-        mux_printf("Ack received! Unlocking shm region and continuing\n----------");
-        pthread_mutex_unlock(&display->shm_lock);
+        // place the update on the outgoing queue, right behind the copy and fills it builds on.
+        if (copy != NULL) {
+            mux_queue_enqueue(&display->outgoing_messages, copy);
+        }
+        if (fill != NULL) {
+            mux_queue_enqueue(&display->outgoing_messages, fill);
+        }
+        mux_queue_enqueue(&display->outgoing_messages, update);
+        mux_printf("Frame %u in slot %d queued", update->disp_update.seq, update->disp_update.slot);
     }
 cleanup:
     pthread_mutex_unlock(&display->shm_lock);
@@ -360,6 +526,109 @@ cleanup:
     return;
 }
 
+/**
+ * @brief Checks whether the next refresh has anything to do.
+ */
+static bool mux_refresh_pending(void)
+{
+    bool pending;
+
+    pthread_mutex_lock(&display->damage_lock);
+    pending = pixman_region32_not_empty(&display->dirty_region);
+    pthread_mutex_unlock(&display->damage_lock);
+    return pending || __atomic_load_n(&display->format_changed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Empties the wakeup eventfd of the refresh timer.
+ */
+static void mux_refresh_timer_drain(void)
+{
+    uint64_t count;
+
+    while (read(display->refresh_timer.wake_fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+}
+
+/**
+ * @brief Wakes the library's refresh timer up if it's waiting for damage. Does nothing if the timer isn't running, or
+ * already has a refresh scheduled.
+ */
+void mux_refresh_timer_wake(void)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&display->refresh_timer.idle, false, __ATOMIC_SEQ_CST)) {
+        if (write(display->refresh_timer.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            mux_printf_error("Could not wake the refresh timer: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * @func Refresh timer loop, started by mux_start_refresh_timer(). It calls mux_display_refresh() at the interval the
+ * pacing controller picks, and sleeps without a timer while there's no damage, until mux_display_update() wakes it.
+ *
+ * @param arg Not used, just there to satisfy pthreads.
+ */
+static void *mux_refresh_loop(void *arg)
+{
+    struct pollfd fds[2] = {
+        { .fd = display->refresh_timer.timer_fd, .events = POLLIN },
+        { .fd = display->refresh_timer.wake_fd, .events = POLLIN },
+    };
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+    uint32_t interval;
+    uint64_t expirations;
+    int64_t waited_ns;
+
+    interval = mux_display_refresh();
+    while (!__atomic_load_n(&display->refresh_timer.stop, __ATOMIC_ACQUIRE)) {
+        waited_ns = 0;
+
+        // idle has to be set before looking for damage, or an update could slip in between and never wake us.
+        __atomic_store_n(&display->refresh_timer.idle, true, __ATOMIC_SEQ_CST);
+        if (!mux_refresh_pending()) {
+            int64_t start_ns = mux_time_ns();
+            mux_printf("No damage, refresh timer going idle");
+            poll(&fds[1], 1, -1);
+            waited_ns = mux_time_ns() - start_ns;
+        }
+        __atomic_store_n(&display->refresh_timer.idle, false, __ATOMIC_SEQ_CST);
+        mux_refresh_timer_drain();
+
+        // damage that shows up after a long idle stretch gets sent right away.
+        if (waited_ns < (int64_t) interval * 1000000) {
+            int64_t remaining_ns = ((int64_t) interval * 1000000) - waited_ns;
+            spec.it_value.tv_sec = remaining_ns / 1000000000;
+            spec.it_value.tv_nsec = remaining_ns % 1000000000;
+            timerfd_settime(display->refresh_timer.timer_fd, 0, &spec, NULL);
+
+            // more damage before the timer fires doesn't need waking for; only stopping does.
+            while (!__atomic_load_n(&display->refresh_timer.stop, __ATOMIC_ACQUIRE)) {
+                if (poll(fds, 2, -1) < 0) {
+                    continue;
+                }
+                if (fds[1].revents & POLLIN) {
+                    mux_refresh_timer_drain();
+                }
+                if ((fds[0].revents & POLLIN) &&
+                    read(display->refresh_timer.timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    break;
+                }
+            }
+        }
+
+        if (__atomic_load_n(&display->refresh_timer.stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        interval = mux_display_refresh();
+    }
+
+    mux_printf("Now exiting refresh timer loop!");
+    return NULL;
+}
+
 /**
  * @func Unused, stubbed out until formal removal.
  *
@@ -371,15 +640,34 @@ __PUBLIC void *mux_display_buffer_update_loop(void *arg)
 }
 
 
-static void mux_send_shutdown_msg()
+/**
+ * @brief Encodes an update and sends it to the server, retrying until it goes through.
+ *
+ * @param update The update, or NULL for a shutdown message.
+ */
+static void mux_send_update(MuxUpdate *update)
 {
-    nnStr msg;
-    msg.buf = NULL;
-    size_t len = mux_write_outgoing_msg(NULL, &msg); // NULL means shutdown!
-    while(mux_0mq_send_msg(msg.buf, len) < 0) {
-        mux_printf_error("Failed to send shutdown message!");
+    uint8_t *buf;
+    size_t len;
+
+    // sending takes the buffer over even if it fails, so every attempt encodes into a fresh one. a message only
+    // fails as a whole before any of it went out, or once the context is gone and nothing can be sent anymore.
+    while (true) {
+        buf = mux_0mq_buffer_new();
+        len = mux_write_outgoing_msg(update, buf);
+        if (mux_0mq_send_msg(buf, len) >= 0) {
+            break;
+        }
+        mux_printf_error("Failed to send message");
+        if (zmq_errno() == ETERM) {
+            break;
+        }
     }
-    g_free(msg.buf);
+}
+
+static void mux_send_shutdown_msg()
+{
+    mux_send_update(NULL); // NULL means shutdown!
     mux_printf("Shutdown message sent!");
 }
 
@@ -394,36 +682,42 @@ __PUBLIC void *mux_mainloop(void *arg)
 {
     mux_printf("Reached qemu shim in loop thread!");
     void *buf = NULL;
-    size_t len;
-    zpoller_t *poller = display->zmq.poller;
+    // the buffer pool has to outlive the last message sent from here, shutdown message included
+    mux_0mq_buffers_ref();
+    MuxUpdate *update;
     bool stopping = false;
+    zmq_pollitem_t items[2] = {
+        { .socket = zsock_resolve(display->zmq.socket), .events = ZMQ_POLLIN },
+        { .socket = NULL, .fd = display->outgoing_messages.event_fd, .events = ZMQ_POLLIN },
+    };
 
     // main shim receive loop
     int nbytes;
     while(!stopping) {
-        nnStr msg;
-        msg.buf = NULL;
         buf = NULL;
 
-        while(!mux_queue_check_is_empty(&display->outgoing_messages)) {
-            MuxUpdate *update = (MuxUpdate *) mux_queue_dequeue(&display->outgoing_messages); // blocks until something in queue
-            len = mux_write_outgoing_msg(update, &msg); // serialize update to buf
-            while (mux_0mq_send_msg(msg.buf, len) < 0) {
-                mux_printf_error("Failed to send message");
-            }
-            g_free(update); // update is no longer needed, free it
-            g_free(msg.buf); // free buf, no longer needed.
-            msg.buf = NULL;
+        while ((update = mux_queue_try_dequeue(&display->outgoing_messages)) != NULL) {
+            mux_send_update(update);
+            mux_update_free(update); // update is no longer needed, recycle it
+        }
+
+        // an update may have been queued after the queue was emptied, in which case there's no sleeping yet.
+        if (!mux_queue_prepare_wait(&display->outgoing_messages)) {
+            continue;
         }
 
-        // block on receiving messages
-        zsock_t *which = (zsock_t *) zpoller_wait(poller, 5); // 5ms timeout
-        if (which != display->zmq.socket)  {
-            if (zpoller_terminated(poller)) {
-                mux_printf_error("Zpoller terminated!");
+        // sleep until the server sends something, an update is queued, or the library is stopping.
+        if (zmq_poll(items, 2, -1) < 0) {
+            mux_queue_finish_wait(&display->outgoing_messages);
+            if (zmq_errno() == ETERM || zsys_interrupted) {
+                mux_printf_error("Poll terminated!");
                 stopping = true;
             }
-        } else {
+            continue;
+        }
+        mux_queue_finish_wait(&display->outgoing_messages);
+
+        if (items[0].revents & ZMQ_POLLIN) {
             nbytes = mux_0mq_recv_msg(&buf);
             if (nbytes > 0) {
                 // successful recv is successful
@@ -450,30 +744,20 @@ __PUBLIC void *mux_mainloop(void *arg)
     mux_send_shutdown_msg();
 
     // clean up socket
-    if (!zpoller_terminated(display->zmq.poller)) {
-        zpoller_destroy(&display->zmq.poller);
-    }
 //    zsock_set_linger(display->zmq.socket, 1);
     zsock_disconnect(display->zmq.socket, "%s", display->zmq.path);
     zsock_destroy(&display->zmq.socket);
+    zmq_msg_close(&display->zmq.identity);
+    mux_0mq_buffers_unref();
+    if (display->fd_socket >= 0) {
+        close(display->fd_socket);
+    }
     // signal to wake up other thread
     pthread_cond_signal(&display->update_cond);
     pthread_cond_signal(&display->shm_cond);
     return NULL;
 }
 
-/**
- * @func Initializes a queue.
- *
- * @param q The queue to initialize.
- */
-static void mux_init_queue(MuxMsgQueue *q)
-{
-    SIMPLEQ_INIT(&q->updates);
-    pthread_cond_init(&q->cond, NULL);
-    pthread_mutex_init(&q->lock, NULL);
-}
-
 /**
  * @func This function initializes the data structures used by the library. It also returns a pointer to the ShimDisplay
  * struct initialized, which is defined as an opaque type in the public header so that client code can't mess with it.
@@ -487,11 +771,15 @@ __PUBLIC MuxDisplay *mux_init_display_struct(const char *uuid)
 {
     display = g_malloc0(sizeof(MuxDisplay));
     display->shmem_fd = -1;
-    display->dirty_update = NULL;
-    display->out_update = NULL;
+    display->fd_socket = -1;
+    display->refresh_timer.timer_fd = -1;
+    display->refresh_timer.wake_fd = -1;
+    pixman_region32_init(&display->dirty_region);
+    mux_shm_init_slots();
     display->uuid = NULL;
     display->zmq.socket = NULL;
-    display->framerate = 20;
+    __atomic_store_n(&display->framerate, 20, __ATOMIC_RELAXED);
+    mux_pacing_init();
 
     if (uuid != NULL) {
         if (strlen(uuid) != 36) {
@@ -510,9 +798,16 @@ __PUBLIC MuxDisplay *mux_init_display_struct(const char *uuid)
 
     pthread_cond_init(&display->shm_cond, NULL);
     pthread_mutex_init(&display->shm_lock, NULL);
+    pthread_mutex_init(&display->damage_lock, NULL);
+    pthread_mutex_init(&display->refresh_lock, NULL);
     pthread_cond_init(&display->update_cond, NULL);
 
-    mux_init_queue(&display->outgoing_messages);
+    if (!mux_queue_init(&display->outgoing_messages)) {
+        free(display);
+        return NULL;
+    }
+    mux_update_pool_init(&display->update_pool);
+    mux_framebuffer_calibrate();
 
     return display;
 }
@@ -526,6 +821,136 @@ __PUBLIC void mux_register_event_callbacks(InputEventCallbacks cb)
     callbacks = cb;
 }
 
+/**
+ * @func Sets the number of worker threads used to copy large framebuffer updates. Updates smaller than
+ * MUX_PARALLEL_MIN_BYTES are always copied on the calling thread.
+ *
+ * By default no worker threads are started and every copy happens on the thread calling into the library. This
+ * should be called before the display loops are started.
+ *
+ * @returns Whether all the requested threads could be started.
+ *
+ * @param nthreads Number of worker threads, between 0 and MUX_MAX_COPY_THREADS. 0 disables the worker pool.
+ */
+__PUBLIC bool mux_set_copy_threads(int nthreads)
+{
+    return mux_workers_start(nthreads);
+}
+
+/**
+ * @func Sets the number of framebuffer slots in the shared memory region. With more than one slot, the library can
+ * write a new frame while the server is still reading the previous one, instead of waiting for its acknowledgement.
+ *
+ * Takes effect on the next call to mux_display_switch(). Slots that don't fit in the shared memory region at the
+ * current resolution are not used.
+ *
+ * @param nslots Number of slots, between 1 and MUX_MAX_FRAMEBUFFER_SLOTS.
+ */
+__PUBLIC void mux_set_framebuffer_slots(int nslots)
+{
+    display->requested_slots = CLAMP(nslots, 1, MUX_MAX_FRAMEBUFFER_SLOTS);
+}
+
+/**
+ * @func Lets the server read frames straight out of shared memory, guided by the header at the start of the region,
+ * instead of acknowledging every display update. Display updates are still sent, but the library doesn't wait for
+ * DISPLAY_UPDATE_COMPLETE before reusing a slot; the server detects torn reads with the sequence locks in the header
+ * instead.
+ *
+ * Takes effect on the next call to mux_display_switch().
+ *
+ * @param enabled Whether to stop waiting for acknowledgements.
+ */
+__PUBLIC void mux_set_ackless_updates(bool enabled)
+{
+    display->requested_ackless = enabled;
+}
+
+/**
+ * @func Backs the shared memory region with transparent hugepages, which saves TLB misses in both the library and the
+ * server when scanning large framebuffers. The region is then sized in multiples of 2MB. If the kernel can't provide
+ * hugepages, normal pages are used instead.
+ *
+ * Hugepages for shared memory have to be allowed in /sys/kernel/mm/transparent_hugepage/shmem_enabled ("advise" or
+ * "always"). Takes effect the next time the region is resized, usually on the next display switch.
+ *
+ * @param enabled Whether to ask for hugepages.
+ */
+__PUBLIC void mux_set_hugepages(bool enabled)
+{
+    display->hugepages = enabled;
+}
+
+/**
+ * @func Starts a thread that refreshes the display on its own, so the hypervisor doesn't have to call
+ * mux_display_refresh() on a timer. The thread follows the interval mux_display_refresh() would have returned, and
+ * sleeps without waking up at all while the display isn't damaged.
+ *
+ * mux_display_update() and mux_display_switch() may still be called from any thread. mux_display_refresh() shouldn't
+ * be called by the hypervisor once the timer is running. Should be called after mux_init_display_struct().
+ *
+ * @returns Whether the timer thread could be started.
+ */
+__PUBLIC bool mux_start_refresh_timer(void)
+{
+    if (display->refresh_timer.running) {
+        return true;
+    }
+
+    display->refresh_timer.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (display->refresh_timer.timer_fd < 0) {
+        mux_printf_error("Could not create refresh timer: %s", strerror(errno));
+        return false;
+    }
+    display->refresh_timer.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (display->refresh_timer.wake_fd < 0) {
+        mux_printf_error("Could not create refresh timer eventfd: %s", strerror(errno));
+        goto fail;
+    }
+
+    display->refresh_timer.stop = false;
+    display->refresh_timer.idle = false;
+    if (pthread_create(&display->refresh_timer.thread, NULL, mux_refresh_loop, NULL) != 0) {
+        mux_printf_error("Could not start refresh timer thread");
+        goto fail;
+    }
+    display->refresh_timer.running = true;
+    return true;
+
+fail:
+    close(display->refresh_timer.timer_fd);
+    display->refresh_timer.timer_fd = -1;
+    if (display->refresh_timer.wake_fd >= 0) {
+        close(display->refresh_timer.wake_fd);
+        display->refresh_timer.wake_fd = -1;
+    }
+    return false;
+}
+
+/**
+ * @brief Stops the refresh timer thread, if it's running.
+ */
+static void mux_stop_refresh_timer(void)
+{
+    uint64_t one = 1;
+
+    if (!display->refresh_timer.running) {
+        return;
+    }
+
+    __atomic_store_n(&display->refresh_timer.stop, true, __ATOMIC_RELEASE);
+    if (write(display->refresh_timer.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        mux_printf_error("Could not wake the refresh timer: %s", strerror(errno));
+    }
+    pthread_join(display->refresh_timer.thread, NULL);
+    display->refresh_timer.running = false;
+
+    close(display->refresh_timer.timer_fd);
+    close(display->refresh_timer.wake_fd);
+    display->refresh_timer.timer_fd = -1;
+    display->refresh_timer.wake_fd = -1;
+}
+
 /**
  * @func Should be called to safely cleanup library state. Note that ZeroMQ threads may (will) hang around for a long
  * time unless they're cleaned up by this method.
@@ -541,6 +966,12 @@ __PUBLIC void mux_cleanup(MuxDisplay *d)
     pthread_mutex_lock(&display->stop_lock);
     display->stop = true;
     pthread_mutex_unlock(&display->stop_lock);
+    mux_queue_wake(&display->outgoing_messages);
+
+    mux_stop_refresh_timer();
+    mux_workers_stop();
+    mux_scroll_free();
+    mux_0mq_buffers_unref();
 
     // clean up uuid
     g_free(&display->uuid);
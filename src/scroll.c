@@ -0,0 +1,429 @@
+/** @file */
+#include "scroll.h"
+#include "kernels.h"
+
+/*
+ * Scrolling a window damages most of it, even though most of the new pixels were already on screen one line or
+ * column away. Before syncing a large damaged area, the library hashes every row of it in both the new frame and
+ * the previous one, and lets each row that is unique in the previous frame vote for the distance it moved. The
+ * winning shift is checked pixel by pixel, and if it holds for enough rows, the area is sent as a copy of the
+ * previous frame plus whatever is left. If no vertical shift is found, the same is tried with columns.
+ *
+ * Most large damage is video or animation rather than a scroll, so a few sampled rows are first looked for elsewhere
+ * in the previous frame. Only if some of them turn up does the whole area get hashed.
+ */
+
+/**
+ * @brief Entry of the hash table used to look up lines of the previous frame by their hash.
+ */
+typedef struct MuxLineEntry {
+    uint64_t hash;
+    /**
+     * @brief Index of the line, or -1 if the entry is empty.
+     */
+    int line;
+    /**
+     * @brief Number of lines with this hash. Only unique lines get a vote.
+     */
+    int count;
+} MuxLineEntry;
+
+/**
+ * @brief Mixes a value into a running hash.
+ */
+static inline uint64_t mux_scroll_mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+/**
+ * @brief Hashes every row of a rectangle.
+ *
+ * @param data The buffer.
+ * @param step Scanline of the buffer.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param box The rectangle.
+ * @param hashes Filled in with one hash per row.
+ */
+static void mux_scroll_hash_rows(unsigned char *data, int step, int pixelSize, pixman_box32_t *box,
+                                 uint64_t *hashes)
+{
+    int row;
+    size_t lineSize = (size_t) (box->x2 - box->x1) * pixelSize;
+
+    for (row = box->y1; row < box->y2; row++) {
+        hashes[row - box->y1] = mux_kernels.hash(0, data + ((size_t) row * step) + (box->x1 * pixelSize), lineSize);
+    }
+}
+
+/**
+ * @brief Hashes every column of a rectangle. The rectangle is walked row by row, so every column's hash is carried
+ * along in the hashes array.
+ *
+ * @param data The buffer.
+ * @param step Scanline of the buffer.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param box The rectangle.
+ * @param hashes Filled in with one hash per column.
+ */
+static void mux_scroll_hash_columns(unsigned char *data, int step, int pixelSize, pixman_box32_t *box,
+                                    uint64_t *hashes)
+{
+    int row, col;
+    int width = box->x2 - box->x1;
+
+    for (col = 0; col < width; col++) {
+        hashes[col] = box->y2 - box->y1;
+    }
+
+    for (row = box->y1; row < box->y2; row++) {
+        unsigned char *p = data + ((size_t) row * step) + (box->x1 * pixelSize);
+        for (col = 0; col < width; col++) {
+            uint32_t v = 0;
+            memcpy(&v, p + (col * pixelSize), pixelSize);
+            hashes[col] = mux_scroll_mix(hashes[col], v);
+        }
+    }
+}
+
+/**
+ * @brief Finds the distance most lines moved by between two frames.
+ *
+ * @returns The shift s such that line i of the new frame is line i + s of the old one, or 0 if there's no shift
+ * enough unique lines agree on.
+ *
+ * @param oldHashes Hashes of the lines of the old frame.
+ * @param newHashes Hashes of the lines of the new frame.
+ * @param n Number of lines in each frame.
+ */
+static int mux_scroll_vote(const uint64_t *oldHashes, const uint64_t *newHashes, int n)
+{
+    MuxLineEntry *table = display->scroll.table;
+    int *votes = display->scroll.votes;
+    size_t size = 1;
+    size_t mask;
+    int i, best = 0;
+
+    while (size < (size_t) n * 2) {
+        size <<= 1;
+    }
+    mask = size - 1;
+
+    memset(votes, 0, (2 * n + 1) * sizeof(int));
+    for (i = 0; i < (int) size; i++) {
+        table[i].line = -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t pos = oldHashes[i] & mask;
+        while (table[pos].line >= 0 && table[pos].hash != oldHashes[i]) {
+            pos = (pos + 1) & mask;
+        }
+        if (table[pos].line < 0) {
+            table[pos].hash = oldHashes[i];
+            table[pos].line = i;
+            table[pos].count = 0;
+        }
+        table[pos].count++;
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t pos = newHashes[i] & mask;
+        while (table[pos].line >= 0 && table[pos].hash != newHashes[i]) {
+            pos = (pos + 1) & mask;
+        }
+        // blank lines and the like match lines everywhere, so they don't get a say.
+        if (table[pos].line >= 0 && table[pos].count == 1 && table[pos].line != i) {
+            votes[table[pos].line - i + n]++;
+        }
+    }
+
+    for (i = 0; i < 2 * n + 1; i++) {
+        if (votes[i] > votes[best]) {
+            best = i;
+        }
+    }
+
+    return (votes[best] >= MUX_SCROLL_MIN_VOTES) ? best - n : 0;
+}
+
+/**
+ * @brief Finds the longest run of lines that moved by a given shift.
+ *
+ * @returns The length of the run.
+ *
+ * @param oldHashes Hashes of the lines of the old frame.
+ * @param newHashes Hashes of the lines of the new frame.
+ * @param n Number of lines in each frame.
+ * @param shift The shift.
+ * @param start Set to the index of the first line of the run in the new frame.
+ */
+static int mux_scroll_find_run(const uint64_t *oldHashes, const uint64_t *newHashes, int n, int shift, int *start)
+{
+    int i;
+    int run = 0, best = 0;
+
+    for (i = MAX(0, -shift); i < MIN(n, n - shift); i++) {
+        if (newHashes[i] == oldHashes[i + shift]) {
+            run++;
+            if (run > best) {
+                best = run;
+                *start = i - run + 1;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Makes sure the scratch space has room for a number of lines.
+ *
+ * @param n Number of lines.
+ */
+static void mux_scroll_reserve(int n)
+{
+    MuxScrollScratch *scratch = &display->scroll;
+    size_t size = 1;
+
+    if (n <= scratch->lines) {
+        return;
+    }
+
+    while (size < (size_t) n * 2) {
+        size <<= 1;
+    }
+
+    g_free(scratch->hashes);
+    g_free(scratch->table);
+    g_free(scratch->votes);
+    scratch->hashes = g_malloc(2 * n * sizeof(uint64_t));
+    scratch->table = g_malloc(size * sizeof(MuxLineEntry));
+    scratch->votes = g_malloc((2 * n + 1) * sizeof(int));
+    scratch->lines = n;
+}
+
+/**
+ * @brief Offset of the ith sampled line out of n lines. Samples are spread evenly, away from the edges.
+ */
+static inline int mux_scroll_sample(int i, int n)
+{
+    return (n * (2 * i + 1)) / (2 * MUX_SCROLL_PROBE_LINES);
+}
+
+/**
+ * @brief Cheaply checks whether a damaged area could have scrolled vertically.
+ *
+ * A window from the middle of each sampled row of the new frame is looked up among the same windows of every row of
+ * the previous frame. Windows that didn't change say nothing about a scroll, so they're skipped.
+ *
+ * @returns Whether enough sampled rows showed up in another row of the previous frame.
+ *
+ * @param oldData Pointer to the previous frame.
+ * @param oldStep Scanline of the previous frame.
+ * @param newData Pointer to the new frame.
+ * @param newStep Scanline of the new frame.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param box The damaged area.
+ */
+static bool mux_scroll_probe_rows(unsigned char *oldData, int oldStep, unsigned char *newData, int newStep,
+                                  int pixelSize, pixman_box32_t *box)
+{
+    int height = box->y2 - box->y1;
+    int x = box->x1 + ((box->x2 - box->x1 - MUX_SCROLL_PROBE_PIXELS) / 2);
+    size_t len = (size_t) MUX_SCROLL_PROBE_PIXELS * pixelSize;
+    uint64_t *windows = display->scroll.hashes;
+    int i, row, hits = 0;
+
+    for (row = 0; row < height; row++) {
+        windows[row] = mux_kernels.hash(0, oldData + ((size_t) (box->y1 + row) * oldStep) + (x * pixelSize), len);
+    }
+
+    for (i = 0; i < MUX_SCROLL_PROBE_LINES; i++) {
+        int sample = mux_scroll_sample(i, height);
+        uint64_t h = mux_kernels.hash(0, newData + ((size_t) (box->y1 + sample) * newStep) + (x * pixelSize), len);
+
+        if (h == windows[sample]) {
+            continue;
+        }
+        for (row = 0; row < height; row++) {
+            if (windows[row] == h) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return hits >= MUX_SCROLL_PROBE_HITS;
+}
+
+/**
+ * @brief Cheaply checks whether a damaged area could have scrolled horizontally.
+ *
+ * A window from the middle of each sampled row of the new frame is searched for in the same row of the previous
+ * frame. Windows that didn't change say nothing about a scroll, so they're skipped.
+ *
+ * @returns Whether enough sampled rows showed up shifted in the previous frame.
+ *
+ * @param oldData Pointer to the previous frame.
+ * @param oldStep Scanline of the previous frame.
+ * @param newData Pointer to the new frame.
+ * @param newStep Scanline of the new frame.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param box The damaged area.
+ */
+static bool mux_scroll_probe_columns(unsigned char *oldData, int oldStep, unsigned char *newData, int newStep,
+                                     int pixelSize, pixman_box32_t *box)
+{
+    int height = box->y2 - box->y1;
+    int x = box->x1 + ((box->x2 - box->x1 - MUX_SCROLL_PROBE_PIXELS) / 2);
+    size_t len = (size_t) MUX_SCROLL_PROBE_PIXELS * pixelSize;
+    int i, col, hits = 0;
+
+    for (i = 0; i < MUX_SCROLL_PROBE_LINES; i++) {
+        int row = box->y1 + mux_scroll_sample(i, height);
+        unsigned char *pOld = oldData + ((size_t) row * oldStep);
+        unsigned char *pNew = newData + ((size_t) row * newStep) + (x * pixelSize);
+
+        if (!memcmp(pOld + (x * pixelSize), pNew, len)) {
+            continue;
+        }
+        for (col = box->x1; col <= box->x2 - MUX_SCROLL_PROBE_PIXELS; col++) {
+            if (col != x && !memcmp(pOld + (col * pixelSize), pNew, len)) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return hits >= MUX_SCROLL_PROBE_HITS;
+}
+
+/**
+ * @brief Looks for a run of lines that moved by the same distance in one direction.
+ *
+ * @returns Whether such a run was found and verified.
+ *
+ * @param oldData Pointer to the previous frame.
+ * @param oldStep Scanline of the previous frame.
+ * @param newData Pointer to the new frame.
+ * @param newStep Scanline of the new frame.
+ * @param pixelSize Size of a pixel in bytes.
+ * @param box The damaged area.
+ * @param vertical Whether to look at rows rather than columns.
+ * @param copy Filled in with the copy that turns the previous frame into the new one.
+ */
+static bool mux_scroll_detect_lines(unsigned char *oldData, int oldStep, unsigned char *newData, int newStep,
+                                    int pixelSize, pixman_box32_t *box, bool vertical, copy_rect *copy)
+{
+    int n = vertical ? box->y2 - box->y1 : box->x2 - box->x1;
+    uint64_t *oldHashes = display->scroll.hashes;
+    uint64_t *newHashes = oldHashes + n;
+    int shift, start = 0, len = 0;
+    int row;
+
+    if (vertical) {
+        mux_scroll_hash_rows(oldData, oldStep, pixelSize, box, oldHashes);
+        mux_scroll_hash_rows(newData, newStep, pixelSize, box, newHashes);
+    } else {
+        mux_scroll_hash_columns(oldData, oldStep, pixelSize, box, oldHashes);
+        mux_scroll_hash_columns(newData, newStep, pixelSize, box, newHashes);
+    }
+
+    if ((shift = mux_scroll_vote(oldHashes, newHashes, n)) != 0) {
+        len = mux_scroll_find_run(oldHashes, newHashes, n, shift, &start);
+    }
+
+    if (len < MUX_SCROLL_MIN_LINES) {
+        return false;
+    }
+
+    if (vertical) {
+        copy->src = (pixman_box32_t) { box->x1, box->y1 + start + shift, box->x2, box->y1 + start + shift + len };
+        copy->dst_x = box->x1;
+        copy->dst_y = box->y1 + start;
+    } else {
+        copy->src = (pixman_box32_t) { box->x1 + start + shift, box->y1, box->x1 + start + shift + len, box->y2 };
+        copy->dst_x = box->x1 + start;
+        copy->dst_y = box->y1;
+    }
+
+    // hashes can collide, so make sure the pixels really moved.
+    for (row = 0; row < copy->src.y2 - copy->src.y1; row++) {
+        size_t lineSize = (size_t) (copy->src.x2 - copy->src.x1) * pixelSize;
+        unsigned char *pOld = oldData + ((size_t) (copy->src.y1 + row) * oldStep) + (copy->src.x1 * pixelSize);
+        unsigned char *pNew = newData + ((size_t) (copy->dst_y + row) * newStep) + (copy->dst_x * pixelSize);
+
+        if (memcmp(pOld, pNew, lineSize)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @func Looks for a scroll within a damaged area, by comparing the new frame to the previous one.
+ *
+ * @returns Whether a large enough part of the area is a copy of another part of the previous frame.
+ *
+ * @param oldData Pointer to the previous frame.
+ * @param oldStep Scanline of the previous frame.
+ * @param newData Pointer to the new frame, in the same format as the previous one.
+ * @param newStep Scanline of the new frame.
+ * @param bpp Bits per pixel of both frames.
+ * @param box The damaged area. Both the source and destination of the copy lie within it.
+ * @param copy Filled in with the copy that turns the previous frame into the new one, if there is one.
+ */
+bool mux_scroll_detect(unsigned char *oldData, int oldStep, unsigned char *newData, int newStep, int bpp,
+                       pixman_box32_t *box, copy_rect *copy)
+{
+    int pixelSize = (bpp + 7) / 8;
+
+    if (box->x2 - box->x1 < MUX_SCROLL_MIN_SIZE || box->y2 - box->y1 < MUX_SCROLL_MIN_SIZE) {
+        return false;
+    }
+
+    mux_scroll_reserve(MAX(box->x2 - box->x1, box->y2 - box->y1));
+
+    return (mux_scroll_probe_rows(oldData, oldStep, newData, newStep, pixelSize, box) &&
+            mux_scroll_detect_lines(oldData, oldStep, newData, newStep, pixelSize, box, true, copy)) ||
+           (mux_scroll_probe_columns(oldData, oldStep, newData, newStep, pixelSize, box) &&
+            mux_scroll_detect_lines(oldData, oldStep, newData, newStep, pixelSize, box, false, copy));
+}
+
+/**
+ * @func Frees the scratch space of mux_scroll_detect().
+ */
+void mux_scroll_free(void)
+{
+    g_free(display->scroll.hashes);
+    g_free(display->scroll.table);
+    g_free(display->scroll.votes);
+    memset(&display->scroll, 0, sizeof(display->scroll));
+}
+
+/**
+ * @func Applies a copy found by mux_scroll_detect(). The source and destination buffers may be the same.
+ *
+ * @param dstData Pointer to the buffer to copy into.
+ * @param srcData Pointer to the buffer holding the previous frame.
+ * @param step Scanline of both buffers.
+ * @param bpp Bits per pixel of both buffers.
+ * @param copy The copy.
+ */
+void mux_scroll_apply(unsigned char *dstData, unsigned char *srcData, int step, int bpp, copy_rect *copy)
+{
+    int pixelSize = (bpp + 7) / 8;
+    int height = copy->src.y2 - copy->src.y1;
+    size_t lineSize = (size_t) (copy->src.x2 - copy->src.x1) * pixelSize;
+    // when scrolling down within one buffer, rows have to be moved bottom up so none are overwritten before use.
+    bool up = copy->dst_y <= copy->src.y1;
+    int i;
+
+    for (i = 0; i < height; i++) {
+        int row = up ? i : height - 1 - i;
+        memmove(dstData + ((size_t) (copy->dst_y + row) * step) + (copy->dst_x * pixelSize),
+                srcData + ((size_t) (copy->src.y1 + row) * step) + (copy->src.x1 * pixelSize), lineSize);
+    }
+}
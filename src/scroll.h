@@ -0,0 +1,41 @@
+#ifndef SHIM_SCROLL_H
+#define SHIM_SCROLL_H
+
+#include "common.h"
+
+/**
+ * @brief Damage smaller than this many px in either direction isn't worth looking for scrolls in.
+ */
+#define MUX_SCROLL_MIN_SIZE 64
+
+/**
+ * @brief A scroll has to move at least this many rows or columns of the damage to be sent as a copy.
+ */
+#define MUX_SCROLL_MIN_LINES 32
+
+/**
+ * @brief Number of unique rows or columns that have to agree on a shift before it's verified.
+ */
+#define MUX_SCROLL_MIN_VOTES 4
+
+/**
+ * @brief Number of rows sampled to decide whether a damaged area is worth hashing.
+ */
+#define MUX_SCROLL_PROBE_LINES 16
+
+/**
+ * @brief Width in px of the window compared for each sampled row. Must be at most half of MUX_SCROLL_MIN_SIZE.
+ */
+#define MUX_SCROLL_PROBE_PIXELS 32
+
+/**
+ * @brief Number of sampled rows that have to show up elsewhere in the previous frame before the area is hashed.
+ */
+#define MUX_SCROLL_PROBE_HITS 2
+
+bool mux_scroll_detect(unsigned char *oldData, int oldStep, unsigned char *newData, int newStep, int bpp,
+                       pixman_box32_t *box, copy_rect *copy);
+void mux_scroll_apply(unsigned char *dstData, unsigned char *srcData, int step, int bpp, copy_rect *copy);
+void mux_scroll_free(void);
+
+#endif //SHIM_SCROLL_H
@@ -0,0 +1,966 @@
+/** @file */
+#define _GNU_SOURCE
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+#include "shm.h"
+#include "pacing.h"
+#include "queue.h"
+
+_Static_assert(sizeof(MuxShmHeader) <= MUX_SHM_HEADER_SIZE, "shared memory header doesn't fit in its reserved space");
+
+/*
+ * The shared memory region is split into a number of framebuffer slots, so that the library can write a new frame
+ * into one slot while the server is still reading an older frame out of another. Every slot moves through the
+ * following states:
+ *
+ *   FREE -> WRITING -> READY -> INFLIGHT -> FREE
+ *
+ * A slot is READY once it holds a frame that changed, which gets a new sequence number, and INFLIGHT once
+ * mux_out_loop() has sent that frame to the server. The server acknowledges every frame with its sequence number, which makes the
+ * slot FREE again. A READY slot that hasn't been sent yet is reused for the next frame, so damage still coalesces
+ * when the server falls behind.
+ *
+ * Since slots are rewritten out of order, every slot keeps track of the region where it lags behind the latest frame.
+ * That region is brought up to date before the slot is reused.
+ *
+ * The region starts with a MuxShmHeader, which describes the framebuffer and points at the latest frame, followed by
+ * the cursor image and then the slots. Both the
+ * header and every slot are guarded by sequence locks, so servers can read frames straight out of shared memory
+ * without taking part in any of the above. In ackless mode, frames are never held for the server at all: a slot is
+ * FREE again as soon as its update has been queued, and readers rely on the sequence locks alone.
+ *
+ * All functions here except mux_shm_init_slots() and mux_shm_open() must be called with shm_lock held.
+ */
+
+/**
+ * @brief Initializes the slot bookkeeping in the display struct.
+ */
+void mux_shm_init_slots(void)
+{
+    int i;
+
+    for (i = 0; i < MUX_MAX_FRAMEBUFFER_SLOTS; i++) {
+        display->slots[i].state = MUX_SLOT_FREE;
+        pixman_region32_init(&display->slots[i].stale);
+        pixman_region32_init(&display->slots[i].update);
+    }
+    display->requested_slots = MUX_DEFAULT_FRAMEBUFFER_SLOTS;
+    display->num_slots = 1;
+    display->latest_slot = 0;
+    display->requested_ackless = false;
+    display->ackless = false;
+    display->zero_copy = false;
+    display->hugepages = false;
+}
+
+/**
+ * @brief Starts a write to the data guarded by a sequence lock.
+ *
+ * @param lock The sequence lock.
+ */
+static void mux_seqlock_write_begin(uint32_t *lock)
+{
+    __atomic_store_n(lock, *lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Ends a write to the data guarded by a sequence lock.
+ *
+ * @param lock The sequence lock.
+ */
+static void mux_seqlock_write_end(uint32_t *lock)
+{
+    __atomic_store_n(lock, *lock + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Rounds a size up to a whole number of pages.
+ *
+ * @param size The size in bytes.
+ */
+static size_t mux_shm_page_align(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    return ((size + page_size - 1) / page_size) * page_size;
+}
+
+/**
+ * @brief Rounds a size up to what the shared memory region is actually sized to.
+ *
+ * @param size The size in bytes.
+ */
+static size_t mux_shm_round_size(size_t size)
+{
+    if (display->hugepages) {
+        return ((size + MUX_HUGEPAGE_SIZE - 1) / MUX_HUGEPAGE_SIZE) * MUX_HUGEPAGE_SIZE;
+    }
+    return mux_shm_page_align(size);
+}
+
+/**
+ * @brief Asks the kernel to back the shared memory region with transparent hugepages, if the hypervisor asked for
+ * them. If the kernel doesn't support them, the region goes back to normal pages for good.
+ */
+static void mux_shm_advise_hugepages(void)
+{
+    if (!display->hugepages) {
+        return;
+    }
+
+    if (madvise(display->shm_buffer, display->shm_size, MADV_HUGEPAGE)) {
+        mux_printf_error("Hugepages unavailable for the shm region, using normal pages: %s", strerror(errno));
+        display->hugepages = false;
+    }
+}
+
+/**
+ * @brief Connects to the unix socket the server receives shared memory file descriptors on. Its path is the path of
+ * the 0mq socket with ".fd" appended, which only exists for ipc:// endpoints.
+ *
+ * @returns Whether the connection succeeded.
+ */
+static bool mux_shm_connect_fd_socket(void)
+{
+    const char *prefix = "ipc://";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (display->zmq.path == NULL || strncmp(display->zmq.path, prefix, strlen(prefix)) != 0) {
+        return false;
+    }
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.fd",
+                 display->zmq.path + strlen(prefix)) >= (int) sizeof(addr.sun_path)) {
+        mux_printf_error("fd socket path for %s is too long", display->zmq.path);
+        return false;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        mux_printf_error("fd socket creation failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        mux_printf("Server doesn't accept shm file descriptors on %s: %s", addr.sun_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    display->fd_socket = fd;
+    return true;
+}
+
+/**
+ * @brief Hands a shared memory file descriptor to the server, tagged with the generation that display switches will
+ * refer to it by.
+ *
+ * @returns Whether the file descriptor was sent.
+ *
+ * @param fd The file descriptor.
+ * @param generation Generation of the shared memory region.
+ */
+static bool mux_shm_send_fd(int fd, uint32_t generation)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov = { .iov_base = &generation, .iov_len = sizeof(generation) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(display->fd_socket, &msg, MSG_NOSIGNAL) != sizeof(generation)) {
+        mux_printf_error("Sending shm file descriptor failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Creates an anonymous memory file for the shared memory region.
+ *
+ * The file is sealed against shrinking, so the server can map it without ever risking SIGBUS. The library gets a new
+ * file instead of shrinking the old one. It isn't handed to the server until it has been mapped, see
+ * mux_shm_publish_fd().
+ *
+ * @returns The file descriptor, or -1 on failure.
+ *
+ * @param size Size of the region in bytes.
+ */
+static int mux_shm_create_memfd(size_t size)
+{
+    int fd = memfd_create("rdpmux", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0) {
+        mux_printf_error("memfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, size) || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL)) {
+        mux_printf_error("Setting up memfd failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Hands a mapped anonymous memory file to the server as the next generation of the shared memory region.
+ *
+ * The generation only advances once the server has the file, so display switches never name a generation the server
+ * doesn't know about.
+ *
+ * @returns Whether the file descriptor was sent.
+ *
+ * @param fd The file descriptor.
+ */
+static bool mux_shm_publish_fd(int fd)
+{
+    if (!mux_shm_send_fd(fd, display->shm_generation + 1)) {
+        return false;
+    }
+
+    display->shm_generation++;
+    return true;
+}
+
+/**
+ * @brief Checks whether an existing named shared memory object was left behind by a process that has since died.
+ *
+ * Every library instance holds an exclusive flock on its named object for as long as it has it open, and the kernel
+ * drops that lock when the process dies. The object is only stale if the lock can be taken, and the name still refers
+ * to the object the lock was taken on.
+ *
+ * @returns Whether the object can safely be removed.
+ *
+ * @param name Name of the shared memory object.
+ */
+static bool mux_shm_named_is_stale(const char *name)
+{
+    struct stat locked, current;
+    bool stale = false;
+    int fd, check_fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        // already gone, so there's nothing to take over
+        return errno == ENOENT;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &locked) == 0) {
+        if ((check_fd = shm_open(name, O_RDONLY, 0)) >= 0) {
+            stale = fstat(check_fd, &current) == 0 && current.st_ino == locked.st_ino &&
+                    current.st_dev == locked.st_dev;
+            close(check_fd);
+        }
+    }
+
+    close(fd);
+    return stale;
+}
+
+/**
+ * @brief Creates the named shared memory object the server opens when it doesn't take file descriptors.
+ *
+ * @returns The file descriptor, or -1 on failure.
+ *
+ * @param size Size of the region in bytes.
+ */
+static int mux_shm_create_named(size_t size)
+{
+    const char *socket_fmt = "/%d.rdpmux";
+    char socket_str[20] = ""; // 20 is a magic number carefully chosen
+                              // to be the length of INT_MAX plus the characters
+                              // in socket_fmt. If you change socket_fmt, make
+                              // sure to change this too.
+
+    sprintf(socket_str, socket_fmt, display->vm_id);
+
+    // this is the shm buffer being created! Hooray!
+    int shim_fd = shm_open(socket_str,
+                           O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
+    if (shim_fd < 0 && errno == EEXIST) {
+        if (!mux_shm_named_is_stale(socket_str)) {
+            mux_printf_error("shm object %s is in use by another process", socket_str);
+            return -1;
+        }
+
+        // left behind by a previous run of this VM that didn't shut down cleanly
+        mux_printf("Removing stale shm object %s", socket_str);
+        shm_unlink(socket_str);
+        shim_fd = shm_open(socket_str, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
+    }
+    if (shim_fd < 0) {
+        mux_printf_error("shm_open failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // held until the file descriptor is closed, to tell other instances that the object is in use
+    if (flock(shim_fd, LOCK_EX | LOCK_NB)) {
+        mux_printf_error("Locking shm object %s failed: %s", socket_str, strerror(errno));
+        close(shim_fd);
+        shm_unlink(socket_str);
+        return -1;
+    }
+
+    if (ftruncate(shim_fd, size)) {
+        mux_printf_error("ftruncate of new buffer failed: %s", strerror(errno));
+        close(shim_fd);
+        return -1;
+    }
+    return shim_fd;
+}
+
+/**
+ * @brief Maps a freshly created shared memory file.
+ *
+ * @returns The mapping, or NULL on failure.
+ *
+ * @param fd The file descriptor.
+ * @param size Size of the file in bytes.
+ */
+static void *mux_shm_map(int fd, size_t size)
+{
+    // mmap the shm region into our process space
+    void *shm_buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm_buffer == MAP_FAILED) {
+        mux_printf_error("mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+    return shm_buffer;
+}
+
+/**
+ * @brief Makes a mapped shared memory file the shared memory region.
+ *
+ * @param fd The file descriptor.
+ * @param shm_buffer The mapping of the file.
+ * @param size Size of the file in bytes.
+ */
+static void mux_shm_install(int fd, void *shm_buffer, size_t size)
+{
+    // save our new shm file descriptor and the pointer to the buffer for later use
+    display->shmem_fd = fd;
+    display->shm_buffer = shm_buffer;
+    display->shm_size = size;
+    display->shm_header = shm_buffer;
+    mux_shm_advise_hugepages();
+
+    // the region comes zero-filled, so only the constant fields need filling in.
+    display->shm_header->magic = MUX_SHM_MAGIC;
+    display->shm_header->version = MUX_SHM_HEADER_VERSION;
+    display->shm_header->slot_offset = MUX_SHM_SLOT_OFFSET;
+    display->shm_header->cursor_offset = MUX_SHM_HEADER_SIZE;
+}
+
+/**
+ * @brief Creates and maps the shared memory region, if that hasn't happened yet.
+ *
+ * If the server accepts file descriptors, the region is an anonymous memory file handed straight to it, which leaves
+ * nothing behind if the hypervisor dies. Otherwise, the region is a named shared memory object.
+ *
+ * @returns Whether the shared memory region is available.
+ */
+bool mux_shm_open(void)
+{
+    // the region starts out with just the header and the cursor area, and grows with the framebuffer
+    size_t shm_size = mux_shm_round_size(MUX_SHM_SLOT_OFFSET);
+    void *shm_buffer = NULL;
+    int fd = -1;
+
+    if (display->shmem_fd >= 0) {
+        return true;
+    }
+
+    if (mux_shm_connect_fd_socket()) {
+        if ((fd = mux_shm_create_memfd(shm_size)) >= 0 && (shm_buffer = mux_shm_map(fd, shm_size)) != NULL &&
+            !mux_shm_publish_fd(fd)) {
+            munmap(shm_buffer, shm_size);
+            shm_buffer = NULL;
+        }
+        if (shm_buffer == NULL) {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            close(display->fd_socket);
+            display->fd_socket = -1;
+        }
+    }
+
+    if (fd < 0) {
+        if ((fd = mux_shm_create_named(shm_size)) < 0) {
+            return false;
+        }
+        if ((shm_buffer = mux_shm_map(fd, shm_size)) == NULL) {
+            close(fd);
+            return false;
+        }
+    }
+
+    mux_shm_install(fd, shm_buffer, shm_size);
+    return true;
+}
+
+/**
+ * @brief Replaces a sealed shared memory region with a smaller one. The server drops the old region once it sees a
+ * display switch with the new generation.
+ *
+ * Moves the region, so this must only be called while nothing points into it. The cursor is carried over to the new
+ * region.
+ *
+ * @returns Whether the region was replaced.
+ *
+ * @param size New size of the region in bytes.
+ */
+static bool mux_shm_replace(size_t size)
+{
+    void *old_buffer = display->shm_buffer;
+    size_t old_size = display->shm_size;
+    int old_fd = display->shmem_fd;
+    void *shm_buffer;
+    int fd;
+
+    size = mux_shm_round_size(size);
+    if ((fd = mux_shm_create_memfd(size)) < 0) {
+        return false;
+    }
+
+    if ((shm_buffer = mux_shm_map(fd, size)) == NULL) {
+        close(fd);
+        return false;
+    }
+
+    // the old region stays in use if the server can't be told about the new one
+    if (!mux_shm_publish_fd(fd)) {
+        munmap(shm_buffer, size);
+        close(fd);
+        return false;
+    }
+
+    mux_shm_install(fd, shm_buffer, size);
+
+    // nobody reads the new region before the display switch announcing it, so no need to take the cursor lock.
+    display->shm_header->cursor = ((MuxShmHeader *) old_buffer)->cursor;
+    memcpy((unsigned char *) display->shm_buffer + MUX_SHM_HEADER_SIZE,
+           (unsigned char *) old_buffer + MUX_SHM_HEADER_SIZE, MUX_SHM_CURSOR_SIZE);
+
+    mux_printf("Replaced shm region of %zu bytes with %zu bytes", old_size, size);
+    munmap(old_buffer, old_size);
+    close(old_fd);
+    return true;
+}
+
+/**
+ * @brief Grows or shrinks the shared memory region.
+ *
+ * Growing the region may move it, which invalidates every pointer into it. Shrinking happens in place. Either way,
+ * the server must not be reading anything past the new size.
+ *
+ * @returns Whether the region now has the requested size.
+ *
+ * @param size New size of the region in bytes.
+ */
+static bool mux_shm_set_size(size_t size)
+{
+    void *shm_buffer;
+
+    size = mux_shm_round_size(size);
+    if (size == display->shm_size) {
+        return true;
+    }
+
+    // the file has to cover the mapping at all times, so it grows before the mapping and shrinks after it.
+    if (size > display->shm_size && ftruncate(display->shmem_fd, size)) {
+        mux_printf_error("ftruncate of shm region to %zu bytes failed: %s", size, strerror(errno));
+        return false;
+    }
+
+    shm_buffer = mremap(display->shm_buffer, display->shm_size, size,
+                        size > display->shm_size ? MREMAP_MAYMOVE : 0);
+    if (shm_buffer == MAP_FAILED) {
+        mux_printf_error("mremap of shm region to %zu bytes failed: %s", size, strerror(errno));
+        return false;
+    }
+
+    if (size < display->shm_size && ftruncate(display->shmem_fd, size)) {
+        mux_printf_error("ftruncate of shm region to %zu bytes failed: %s", size, strerror(errno));
+    }
+
+    mux_printf("Resized shm region from %zu to %zu bytes", display->shm_size, size);
+    display->shm_buffer = shm_buffer;
+    display->shm_header = shm_buffer;
+    display->shm_size = size;
+    mux_shm_advise_hugepages();
+    return true;
+}
+
+/**
+ * @brief Makes sure the shared memory region has room for a frame in slot 0, growing it if necessary. Growing the
+ * region may move it.
+ *
+ * @returns Whether the frame fits.
+ *
+ * @param frame_size Size of the frame in bytes.
+ */
+bool mux_shm_reserve_frame(size_t frame_size)
+{
+    size_t size = MUX_SHM_SLOT_OFFSET + mux_shm_page_align(frame_size);
+
+    // don't let a pending shrink cut the frame off.
+    display->shm_wanted_size = MAX(display->shm_wanted_size, size);
+    return size <= display->shm_size || mux_shm_set_size(size);
+}
+
+/**
+ * @brief Returns a pointer to the start of a framebuffer slot.
+ *
+ * @param slot Index of the slot.
+ */
+unsigned char *mux_shm_slot_data(int slot)
+{
+    return (unsigned char *) display->shm_buffer + MUX_SHM_SLOT_OFFSET + (slot * display->slot_size);
+}
+
+/**
+ * @brief Lays the slots out for a new framebuffer. Every slot is released, and the frame is expected to be copied
+ * into slot 0, which is marked as in flight until the server acknowledges the display switch. Readers of the shared
+ * memory header are held off until mux_shm_finish_reset() is called.
+ *
+ * The region grows to fit the requested number of slots. If it can't, as many slots are used as fit, but at least
+ * one. A named region that is larger than needed is only shrunk once the server has acknowledged the display switch,
+ * since it may still be reading frames of the old framebuffer until then. A sealed region that is more than twice as
+ * large as needed is replaced right away, since the server keeps its own mapping of the old one.
+ *
+ * @returns Whether the framebuffer fits in the region.
+ *
+ * @param width Width of the framebuffer in px.
+ * @param height Height of the framebuffer in px.
+ * @param stride Size of a row of the framebuffer in bytes.
+ * @param format Pixel format of the framebuffer.
+ * @param seq Set to the sequence number of the display switch.
+ */
+bool mux_shm_reset_slots(int width, int height, int stride, pixman_format_code_t format, uint32_t *seq)
+{
+    int i;
+    size_t frame_size = (size_t) stride * height;
+    size_t size;
+    MuxShmHeader *header;
+
+    display->slot_size = mux_shm_page_align(frame_size);
+    display->slot_stride = stride;
+    // the hypervisor renders into slot 0 of a shared surface directly, so there is nothing to put in other slots.
+    display->num_slots = display->zero_copy ? 1 : display->requested_slots;
+
+    // a shared surface points into the region, so it must not move. mux_create_shared_surface() made room for it.
+    size = MUX_SHM_SLOT_OFFSET + display->num_slots * display->slot_size;
+    if (!display->zero_copy && size > display->shm_size) {
+        mux_shm_set_size(size);
+    } else if (!display->zero_copy && display->shm_generation > 0 && size * 2 < display->shm_size) {
+        // a sealed region can't shrink, so a much smaller framebuffer gets a new one.
+        mux_shm_replace(size);
+    }
+    display->num_slots = MIN(display->num_slots,
+                             (int) ((display->shm_size - MUX_SHM_SLOT_OFFSET) / display->slot_size));
+    if (display->num_slots < 1) {
+        mux_printf_error("Framebuffer of %dx%d does not fit in the shared memory region", width, height);
+        return false;
+    }
+    header = display->shm_header;
+    display->shm_wanted_size = MUX_SHM_SLOT_OFFSET + display->num_slots * display->slot_size;
+
+    display->latest_slot = 0;
+    display->ackless = display->requested_ackless;
+
+    for (i = 0; i < MUX_MAX_FRAMEBUFFER_SLOTS; i++) {
+        MuxFramebufferSlot *slot = &display->slots[i];
+        slot->state = MUX_SLOT_FREE;
+        slot->has_copy = false;
+        slot->fill.num_rects = 0;
+        pixman_region32_clear(&slot->update);
+        if (i == 0) {
+            pixman_region32_clear(&slot->stale);
+        } else {
+            pixman_region32_fini(&slot->stale);
+            pixman_region32_init_rect(&slot->stale, 0, 0, width, height);
+        }
+    }
+
+    display->slots[0].state = display->ackless ? MUX_SLOT_FREE : MUX_SLOT_INFLIGHT;
+    display->slots[0].seq = ++display->frame_seq;
+    display->slots[0].sent_ns = mux_time_ns();
+    display->switch_seq = display->slots[0].seq;
+
+    mux_seqlock_write_begin(&header->lock);
+    header->flags = (display->ackless ? MUX_SHM_FLAG_ACKLESS : 0) | (display->zero_copy ? MUX_SHM_FLAG_ZERO_COPY : 0);
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->format = format;
+    header->num_slots = display->num_slots;
+    header->latest_slot = 0;
+    header->frame_seq = display->slots[0].seq;
+    header->slot_size = display->slot_size;
+
+    mux_seqlock_write_begin(&header->slots[0].lock);
+    header->slots[0].seq = display->slots[0].seq;
+    header->slots[0].base_seq = display->slots[0].seq;
+    header->slots[0].num_rects = 1;
+    header->slots[0].rects[0] = (pixman_box32_t) { 0, 0, width, height };
+
+    mux_printf("Framebuffer laid out in %d slots of %zu bytes", display->num_slots, display->slot_size);
+    *seq = display->slots[0].seq;
+    return true;
+}
+
+/**
+ * @brief Lets readers of the shared memory header see the new framebuffer, once it has been copied into slot 0.
+ */
+void mux_shm_finish_reset(void)
+{
+    mux_seqlock_write_end(&display->shm_header->slots[0].lock);
+    mux_seqlock_write_end(&display->shm_header->lock);
+}
+
+/**
+ * @brief Picks a slot to write the next frame into, and marks it as being written.
+ *
+ * A READY slot that hasn't been sent yet is preferred, so that its pending update can be extended. Otherwise, the
+ * first free slot after the latest one is picked.
+ *
+ * @returns The index of the slot, or -1 if every slot is in use by the server.
+ *
+ * @param ref Set to the index of the slot holding the most recent frame, which the new frame should be compared with.
+ */
+int mux_shm_acquire_slot(int *ref)
+{
+    int i;
+    int target = -1;
+
+    for (i = 0; i < display->num_slots; i++) {
+        if (display->slots[i].state == MUX_SLOT_READY) {
+            target = i;
+            break;
+        }
+    }
+
+    for (i = 1; target < 0 && i <= display->num_slots; i++) {
+        int candidate = (display->latest_slot + i) % display->num_slots;
+        if (display->slots[candidate].state == MUX_SLOT_FREE) {
+            target = candidate;
+        }
+    }
+
+    if (target >= 0) {
+        display->slots[target].state = MUX_SLOT_WRITING;
+        mux_seqlock_write_begin(&display->shm_header->slots[target].lock);
+        *ref = display->latest_slot;
+    }
+    return target;
+}
+
+/**
+ * @brief Describes a damage region as a list of rectangles.
+ *
+ * Each rectangle in the region is carried over as-is. If the region is made up of more rectangles than the list can
+ * hold, it is collapsed into the bounding box of the region instead.
+ *
+ * @returns The number of rectangles written to rects.
+ *
+ * @param region The region to describe.
+ * @param rects Array of MUX_MAX_DAMAGE_RECTS rectangles to fill in.
+ */
+static int mux_region_to_rects(pixman_region32_t *region, pixman_box32_t *rects)
+{
+    int n_rects;
+    pixman_box32_t *boxes;
+
+    // a frame that is nothing but a copy has no rectangles of its own.
+    if (!pixman_region32_not_empty(region)) {
+        return 0;
+    }
+
+    boxes = pixman_region32_rectangles(region, &n_rects);
+
+    if (n_rects > MUX_MAX_DAMAGE_RECTS) {
+        rects[0] = *pixman_region32_extents(region);
+        return 1;
+    }
+
+    memcpy(rects, boxes, n_rects * sizeof(pixman_box32_t));
+    return n_rects;
+}
+
+/**
+ * @brief Builds an outgoing display update out of a damage region.
+ *
+ * @returns A newly allocated update of type DISPLAY_UPDATE.
+ *
+ * @param region The region to describe.
+ */
+static MuxUpdate *mux_region_to_update(pixman_region32_t *region)
+{
+    MuxUpdate *update = mux_update_new();
+
+    update->type = DISPLAY_UPDATE;
+    update->disp_update.num_rects = mux_region_to_rects(region, update->disp_update.rects);
+    return update;
+}
+
+/**
+ * @brief Returns whether a slot holds an update that hasn't been sent yet.
+ *
+ * @param slot Index of the slot.
+ */
+bool mux_shm_slot_pending(int slot)
+{
+    MuxFramebufferSlot *s = &display->slots[slot];
+
+    return pixman_region32_not_empty(&s->update) || s->has_copy || s->fill.num_rects > 0;
+}
+
+/**
+ * @brief Adds the areas written by a copy and a set of fills to a region.
+ *
+ * @param region The region to add to.
+ * @param copy The copy, or NULL.
+ * @param fill The fills, or NULL.
+ */
+static void mux_shm_union_extras(pixman_region32_t *region, copy_rect *copy, fill_update *fill)
+{
+    int i;
+
+    if (copy != NULL) {
+        pixman_region32_union_rect(region, region, copy->dst_x, copy->dst_y,
+                                   copy->src.x2 - copy->src.x1, copy->src.y2 - copy->src.y1);
+    }
+
+    for (i = 0; fill != NULL && i < fill->num_rects; i++) {
+        pixman_box32_t *r = &fill->rects[i];
+        pixman_region32_union_rect(region, region, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+    }
+}
+
+/**
+ * @brief Finishes writing a frame into a slot. The slot is now up to date, and every other slot lags behind it in
+ * the changed region. If anything changed, the frame gets a new sequence number, the slot becomes the latest one in
+ * the shared memory header and is handed to mux_out_loop().
+ *
+ * @param slot Index of the slot.
+ * @param changed Region of the frame that changed compared to the previous latest frame, apart from the copy and the
+ * fills.
+ * @param copy Copy within the previous latest frame that the new frame starts from, or NULL. Only allowed if the
+ * slot has no pending update.
+ * @param fill Solid fills painted on the new frame, or NULL.
+ */
+void mux_shm_publish_slot(int slot, pixman_region32_t *changed, copy_rect *copy, fill_update *fill)
+{
+    int i;
+    MuxFramebufferSlot *s = &display->slots[slot];
+    MuxShmHeader *header = display->shm_header;
+    MuxShmSlotHeader *slot_header = &header->slots[slot];
+    pixman_region32_t written;
+
+    pixman_region32_init(&written);
+    pixman_region32_copy(&written, changed);
+    mux_shm_union_extras(&written, copy, fill);
+
+    for (i = 0; i < display->num_slots; i++) {
+        if (i != slot) {
+            pixman_region32_union(&display->slots[i].stale, &display->slots[i].stale, &written);
+        }
+    }
+    pixman_region32_clear(&s->stale);
+
+    if (pixman_region32_not_empty(&written)) {
+        if (!mux_shm_slot_pending(slot)) {
+            s->base_seq = display->frame_seq;
+        }
+        s->seq = ++display->frame_seq;
+    }
+    pixman_region32_union(&s->update, &s->update, changed);
+
+    if (copy != NULL) {
+        s->has_copy = true;
+        s->copy = *copy;
+    }
+
+    for (i = 0; fill != NULL && i < fill->num_rects; i++) {
+        pixman_box32_t *r = &fill->rects[i];
+
+        // once the slot runs out of fills, the rest are sent like any other damage.
+        if (s->fill.num_rects < MUX_MAX_FILL_RECTS) {
+            s->fill.rects[s->fill.num_rects] = *r;
+            s->fill.colours[s->fill.num_rects++] = fill->colours[i];
+        } else {
+            pixman_region32_union_rect(&s->update, &s->update, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+        }
+    }
+
+    if (!mux_shm_slot_pending(slot)) {
+        pixman_region32_fini(&written);
+        mux_seqlock_write_end(&slot_header->lock);
+        s->state = MUX_SLOT_FREE;
+        return;
+    }
+
+    // readers of shared memory don't know about copies and fills, so they're pointed at everything that was written.
+    pixman_region32_copy(&written, &s->update);
+    mux_shm_union_extras(&written, s->has_copy ? &s->copy : NULL, &s->fill);
+
+    slot_header->seq = s->seq;
+    slot_header->base_seq = s->base_seq;
+    slot_header->num_rects = mux_region_to_rects(&written, slot_header->rects);
+    mux_seqlock_write_end(&slot_header->lock);
+    pixman_region32_fini(&written);
+
+    mux_seqlock_write_begin(&header->lock);
+    header->latest_slot = slot;
+    header->frame_seq = s->seq;
+    mux_seqlock_write_end(&header->lock);
+
+    s->state = MUX_SLOT_READY;
+    display->latest_slot = slot;
+    pthread_cond_signal(&display->update_cond);
+}
+
+/**
+ * @brief Takes the READY slot, if there is one, and marks it as in flight. In ackless mode, the slot is released
+ * right away instead.
+ *
+ * @returns A newly allocated display update describing the frame in the slot, or NULL if no slot is ready.
+ *
+ * @param copy Set to a newly allocated copy that has to be sent before the display update, or NULL if there is none.
+ * @param fill Set to newly allocated fills that have to be sent after the copy and before the display update, or
+ * NULL if there are none.
+ */
+MuxUpdate *mux_shm_take_ready_update(MuxUpdate **copy, MuxUpdate **fill)
+{
+    int i;
+
+    for (i = 0; i < display->num_slots; i++) {
+        MuxFramebufferSlot *s = &display->slots[i];
+        if (s->state == MUX_SLOT_READY) {
+            MuxUpdate *update = mux_region_to_update(&s->update);
+            pixman_region32_clear(&s->update);
+            *copy = NULL;
+            if (s->has_copy) {
+                *copy = mux_update_new();
+                (*copy)->type = COPY_RECT;
+                (*copy)->copy = s->copy;
+                (*copy)->copy.seq = s->seq;
+                s->has_copy = false;
+            }
+            *fill = NULL;
+            if (s->fill.num_rects > 0) {
+                *fill = mux_update_new();
+                (*fill)->type = FILL;
+                (*fill)->fill = s->fill;
+                (*fill)->fill.seq = s->seq;
+                s->fill.num_rects = 0;
+            }
+            s->state = display->ackless ? MUX_SLOT_FREE : MUX_SLOT_INFLIGHT;
+            s->sent_ns = mux_time_ns();
+            update->disp_update.slot = i;
+            update->disp_update.seq = s->seq;
+            return update;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Releases the slot of a frame the server is done reading.
+ *
+ * Acks for frames that are no longer in flight, for example because of a display switch in the meantime, are
+ * ignored, as are all acks in ackless mode.
+ *
+ * @param seq Sequence number of the acknowledged frame.
+ * @param has_seq Whether the server sent a sequence number at all. If not, the oldest frame in flight is released.
+ */
+void mux_shm_release_slot(uint32_t seq, bool has_seq)
+{
+    int i;
+    int released = -1;
+
+    if (display->ackless) {
+        return;
+    }
+
+    for (i = 0; i < display->num_slots; i++) {
+        MuxFramebufferSlot *s = &display->slots[i];
+        if (s->state != MUX_SLOT_INFLIGHT) {
+            continue;
+        }
+        if (has_seq ? (s->seq == seq) : (released < 0 || (int32_t) (s->seq - display->slots[released].seq) < 0)) {
+            released = i;
+        }
+    }
+
+    if (released < 0) {
+        mux_printf("Ignoring ack for frame %u, which is not in flight", seq);
+        return;
+    }
+
+    display->slots[released].state = MUX_SLOT_FREE;
+    mux_pacing_record_ack(mux_time_ns() - display->slots[released].sent_ns);
+
+    // once the server has seen the display switch, it no longer reads anything past the current layout. sealed
+    // regions can't shrink, and get replaced on a display switch instead.
+    if (display->slots[released].seq == display->switch_seq && display->shm_generation == 0 &&
+        display->shm_wanted_size < display->shm_size) {
+        mux_shm_set_size(display->shm_wanted_size);
+    }
+    pthread_cond_signal(&display->shm_cond);
+}
+
+/**
+ * @brief Copies a new cursor image into the cursor area of the shared memory region.
+ *
+ * @param cursor Shape of the cursor. The image must fit in the cursor area.
+ * @param pixels The cursor image, as a8r8g8b8 with rows packed to its width.
+ */
+void mux_shm_define_cursor(cursor_define *cursor, const uint32_t *pixels)
+{
+    MuxShmCursorHeader *header = &display->shm_header->cursor;
+
+    mux_seqlock_write_begin(&header->lock);
+    memcpy((unsigned char *) display->shm_buffer + MUX_SHM_HEADER_SIZE, pixels,
+           (size_t) cursor->w * cursor->h * sizeof(uint32_t));
+    header->serial = cursor->serial;
+    header->width = cursor->w;
+    header->height = cursor->h;
+    header->hot_x = cursor->hot_x;
+    header->hot_y = cursor->hot_y;
+    mux_seqlock_write_end(&header->lock);
+}
+
+/**
+ * @brief Updates the cursor position in the shared memory header.
+ *
+ * @param pos The new position of the cursor.
+ */
+void mux_shm_move_cursor(cursor_move *pos)
+{
+    MuxShmCursorHeader *header = &display->shm_header->cursor;
+
+    mux_seqlock_write_begin(&header->lock);
+    header->x = pos->x;
+    header->y = pos->y;
+    header->visible = pos->visible;
+    mux_seqlock_write_end(&header->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef SHIM_SHM_H
+#define SHIM_SHM_H
+
+#include "common.h"
+
+/**
+ * @brief Default number of framebuffer slots.
+ */
+#define MUX_DEFAULT_FRAMEBUFFER_SLOTS 2
+
+/**
+ * @brief Size of a transparent hugepage. The shared memory region is a multiple of this when hugepages are enabled.
+ */
+#define MUX_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+void mux_shm_init_slots(void);
+bool mux_shm_open(void);
+unsigned char *mux_shm_slot_data(int slot);
+bool mux_shm_reserve_frame(size_t frame_size);
+bool mux_shm_reset_slots(int width, int height, int stride, pixman_format_code_t format, uint32_t *seq);
+void mux_shm_finish_reset(void);
+int mux_shm_acquire_slot(int *ref);
+bool mux_shm_slot_pending(int slot);
+void mux_shm_publish_slot(int slot, pixman_region32_t *changed, copy_rect *copy, fill_update *fill);
+MuxUpdate *mux_shm_take_ready_update(MuxUpdate **copy, MuxUpdate **fill);
+void mux_shm_release_slot(uint32_t seq, bool has_seq);
+void mux_shm_define_cursor(cursor_define *cursor, const uint32_t *pixels);
+void mux_shm_move_cursor(cursor_move *pos);
+
+#endif //SHIM_SHM_H
@@ -0,0 +1,211 @@
+/** @file */
+#include "workers.h"
+#include "framebuffer.h"
+
+/**
+ * @brief A job split into horizontal bands. Lives on the stack of the thread that submitted it.
+ */
+typedef struct MuxBandJob {
+    MuxBandFunc fn;
+    void *ctx;
+    /**
+     * @brief Rows of the job. Bands are clipped to these.
+     */
+    int y1;
+    int y2;
+    /**
+     * @brief First row of the first band, aligned to the tile grid.
+     */
+    int first_row;
+    int band_rows;
+    int nbands;
+    /**
+     * @brief Index of the next band to be claimed.
+     */
+    int next_band;
+    /**
+     * @brief Number of worker threads currently working on this job. Guarded by the pool lock.
+     */
+    int active;
+} MuxBandJob;
+
+/**
+ * @brief The copy worker pool. There is at most one job in flight at a time.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_t threads[MUX_MAX_COPY_THREADS];
+    int nthreads;
+    bool stop;
+    MuxBandJob *job;
+    unsigned int generation;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief Claims and runs bands of a job until there are none left.
+ */
+static void mux_workers_drain(MuxBandJob *job)
+{
+    int band;
+
+    while ((band = __atomic_fetch_add(&job->next_band, 1, __ATOMIC_RELAXED)) < job->nbands) {
+        int y1 = job->first_row + (band * job->band_rows);
+        job->fn(job->ctx, band, MAX(y1, job->y1), MIN(y1 + job->band_rows, job->y2));
+    }
+}
+
+/**
+ * @brief Worker thread runloop.
+ */
+static void *mux_worker_loop(void *arg)
+{
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (true) {
+        while (!pool.stop && (pool.job == NULL || pool.generation == seen)) {
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        }
+        if (pool.stop) {
+            break;
+        }
+
+        MuxBandJob *job = pool.job;
+        seen = pool.generation;
+        job->active++;
+        pthread_mutex_unlock(&pool.lock);
+
+        mux_workers_drain(job);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--job->active == 0) {
+            pthread_cond_signal(&pool.done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the copy worker pool, replacing any previously running one.
+ *
+ * @returns Whether all worker threads could be started.
+ *
+ * @param nthreads Number of worker threads. 0 disables the pool; values above MUX_MAX_COPY_THREADS are clamped.
+ */
+bool mux_workers_start(int nthreads)
+{
+    int i;
+
+    mux_workers_stop();
+
+    nthreads = CLAMP(nthreads, 0, MUX_MAX_COPY_THREADS);
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = false;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, mux_worker_loop, NULL)) {
+            mux_printf_error("Could not start copy worker: %s", strerror(errno));
+            break;
+        }
+    }
+    pool.nthreads = i;
+    pthread_mutex_unlock(&pool.lock);
+
+    mux_printf("Started %d copy workers", pool.nthreads);
+    return pool.nthreads == nthreads;
+}
+
+/**
+ * @brief Stops and joins all copy worker threads.
+ */
+void mux_workers_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+}
+
+/**
+ * @brief Decides how many bands a job should be split into.
+ *
+ * Small jobs aren't worth the handoff to other threads, and bands are kept at least one tile row high so that band
+ * edges line up with the tile grid.
+ *
+ * @returns The number of bands, 1 meaning the job should run on the calling thread alone.
+ *
+ * @param y1 First row touched by the job.
+ * @param y2 One past the last row touched by the job.
+ * @param bytes Number of bytes the job touches.
+ */
+int mux_workers_plan_bands(int y1, int y2, size_t bytes)
+{
+    int tile_rows = ((y2 + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE) - (y1 / MUX_TILE_SIZE);
+
+    if (pool.nthreads == 0 || bytes < MUX_PARALLEL_MIN_BYTES) {
+        return 1;
+    }
+    return MAX(1, MIN(pool.nthreads + 1, tile_rows));
+}
+
+/**
+ * @brief Runs a job over horizontal bands of the rows [y1, y2), using the worker pool and the calling thread.
+ *
+ * Band boundaries are aligned to the tile grid. The function returns once every band has been processed. Only one
+ * thread may submit jobs at a time.
+ *
+ * @param y1 First row of the job.
+ * @param y2 One past the last row of the job.
+ * @param nbands Number of bands, as returned by mux_workers_plan_bands().
+ * @param fn Function to run on every band.
+ * @param ctx Context passed to fn.
+ */
+void mux_workers_run_bands(int y1, int y2, int nbands, MuxBandFunc fn, void *ctx)
+{
+    MuxBandJob job;
+    int first_row = y1 - (y1 % MUX_TILE_SIZE);
+    int tiles = ((y2 - first_row) + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE;
+
+    if (nbands <= 1 || pool.nthreads == 0) {
+        fn(ctx, 0, y1, y2);
+        return;
+    }
+
+    job.fn = fn;
+    job.ctx = ctx;
+    job.y1 = y1;
+    job.y2 = y2;
+    job.first_row = first_row;
+    job.band_rows = ((tiles + nbands - 1) / nbands) * MUX_TILE_SIZE;
+    job.nbands = ((tiles * MUX_TILE_SIZE) + job.band_rows - 1) / job.band_rows;
+    job.next_band = 0;
+    job.active = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    mux_workers_drain(&job);
+
+    pthread_mutex_lock(&pool.lock);
+    while (job.active > 0) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+}
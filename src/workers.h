@@ -0,0 +1,36 @@
+#ifndef SHIM_WORKERS_H
+#define SHIM_WORKERS_H
+
+#include "common.h"
+
+/**
+ * @brief Upper bound on the number of copy worker threads.
+ */
+#define MUX_MAX_COPY_THREADS 16
+
+/**
+ * @brief Upper bound on the number of bands a job is split into. The calling thread works on bands too.
+ */
+#define MUX_MAX_BANDS (MUX_MAX_COPY_THREADS + 1)
+
+/**
+ * @brief Jobs touching fewer bytes than this are always run on the calling thread.
+ */
+#define MUX_PARALLEL_MIN_BYTES (1 << 20)
+
+/**
+ * @brief Function run on one horizontal band of a job.
+ *
+ * @param ctx The context passed to mux_workers_run_bands().
+ * @param band Index of the band, starting at 0 for the topmost one.
+ * @param y1 First row of the band.
+ * @param y2 One past the last row of the band.
+ */
+typedef void (*MuxBandFunc)(void *ctx, int band, int y1, int y2);
+
+bool mux_workers_start(int nthreads);
+void mux_workers_stop(void);
+int mux_workers_plan_bands(int y1, int y2, size_t bytes);
+void mux_workers_run_bands(int y1, int y2, int nbands, MuxBandFunc fn, void *ctx);
+
+#endif //SHIM_WORKERS_H